@@ -1,15 +1,160 @@
+#define _GNU_SOURCE  // for sync_file_range's flags
 #include "LibDisk.h"
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+
+#define DISK_BYTES ((size_t) numSectors * sizeof(Sector))
 
 // the disk in memory (static makes it private to the file)
 static Sector* disk;
+static int numSectors = NUM_SECTORS;
+
+// set when disk is a mapping of an image file instead of calloc'd memory;
+// only a shared one writes through to the file, a private (copy-on-write)
+// one is synced like memory
+static int diskMapped = 0;
+static int diskShared = 0;
+static int diskFd = -1;
+
+// the image file the disk was mapped, loaded or last fully saved from/to;
+// the dirty bitmap is relative to this file
+static char* diskPath = NULL;
+
+// one bit per sector written since diskPath was last brought up to date
+#define DIRTY_WORD_BITS ((int) (8 * sizeof(unsigned long)))
+#define DIRTY_WORDS ((numSectors + DIRTY_WORD_BITS - 1) / DIRTY_WORD_BITS)
+static unsigned long* dirty;
+
+// how many Disk_Get()s are outstanding on each sector, and on how many sectors
+static unsigned short* pins;
+static int pinnedSectors = 0;
+
+// guards the dirty bits and pin counts, so different threads can get, put
+// and write sectors at the same time
+static pthread_mutex_t diskLock = PTHREAD_MUTEX_INITIALIZER;
 
 // used to see what happened w/ disk ops
-Disk_Error_t diskErrno; 
+__thread Disk_Error_t diskErrno; 
+
+static int Disk_Save_Image(char* file);
+static void Writeback_Drain();
+static void Writeback_Drain_Range(int sector, int count);
+static void Mark_Dirty_Range(int sector, int count);
+
+// used for statistics (only kept in FS_STATS builds, the counting
+// compiles away otherwise)
+#ifdef FS_STATS
+static Disk_Stats stats;
+static int lastSector = 0;
+static int spanFirst[DISK_MAX_SPANS];
+static int spanRegion[DISK_MAX_SPANS];
+static int numSpans = 0;
+static void Count_Access(int sector, int count, int isWrite);
+#define COUNT_ACCESS(sector, count, isWrite)  Count_Access(sector, count, isWrite)
+#else
+#define COUNT_ACCESS(sector, count, isWrite)
+#endif
+
+// the timing model, and where it has got to (guarded by modelLock); with
+// none set an access costs one load and a branch
+static Disk_Model model = { .type = DISK_MODEL_NONE };
+static long simTime = 0;                        // simulated nanoseconds so far
+static int headSector = 0;                      // HDD: where the last access ended
+static long channelBusy[DISK_MAX_CHANNELS];     // SSD: when each channel is next free
+static pthread_mutex_t modelLock = PTHREAD_MUTEX_INITIALIZER;
+static void Time_Access(int sector, int count, int isWrite);
 
-// used for statistics
-// static int lastSector = 0;
-// static int seekCount = 0;
+// every transfer to or from the disk goes through one of these
+#define ACCESS_READ(sector, count)  do { \
+        COUNT_ACCESS(sector, count, 0); \
+        if (__atomic_load_n(&model.type, __ATOMIC_RELAXED) != DISK_MODEL_NONE) Time_Access(sector, count, 0); \
+    } while (0)
+#define ACCESS_WRITE(sector, count) do { \
+        COUNT_ACCESS(sector, count, 1); \
+        if (__atomic_load_n(&model.type, __ATOMIC_RELAXED) != DISK_MODEL_NONE) Time_Access(sector, count, 1); \
+    } while (0)
+
+/*
+ * Set_Image
+ *
+ * Remembers which image file the disk now matches and marks every sector
+ * clean against it.
+ */
+static void Set_Image(char* file)
+{
+    free(diskPath);
+    diskPath = (file == NULL) ? NULL : strdup(file);
+    if (dirty != NULL) {
+        memset(dirty, 0, DIRTY_WORDS * sizeof(unsigned long));
+    }
+}
+
+/*
+ * Set_Size
+ *
+ * Sizes the per-sector bookkeeping (dirty bits, pin counts) for a disk of
+ * sectors sectors. New_Size only allocates it and Use_Size swaps it in, for
+ * callers that must not lose the old disk if the allocation fails.
+ */
+static int New_Size(int sectors, unsigned long** newDirty, unsigned short** newPins)
+{
+    *newDirty = calloc((sectors + DIRTY_WORD_BITS - 1) / DIRTY_WORD_BITS, sizeof(unsigned long));
+    *newPins = calloc(sectors, sizeof(unsigned short));
+    if (*newDirty == NULL || *newPins == NULL) {
+        free(*newDirty);
+        free(*newPins);
+        diskErrno = E_MEM_OP;
+        return -1;
+    }
+    return 0;
+}
+
+static void Use_Size(int sectors, unsigned long* newDirty, unsigned short* newPins)
+{
+    free(dirty);
+    free(pins);
+    dirty = newDirty;
+    pins = newPins;
+    numSectors = sectors;
+}
+
+static int Set_Size(int sectors)
+{
+    unsigned long* newDirty;
+    unsigned short* newPins;
+
+    if (New_Size(sectors, &newDirty, &newPins) == -1) {
+        return -1;
+    }
+    Use_Size(sectors, newDirty, newPins);
+    return 0;
+}
+
+static void Disk_Release()
+{
+    if (disk == NULL) {
+        return;
+    }
+    if (diskMapped) {
+        munmap(disk, DISK_BYTES);
+        close(diskFd);
+        diskFd = -1;
+        diskMapped = 0;
+        diskShared = 0;
+    } else {
+        free(disk);
+    }
+    disk = NULL;
+    Set_Image(NULL);
+}
 
 /*
  * Disk_Init
@@ -21,8 +166,31 @@ Disk_Error_t diskErrno;
  */
 int Disk_Init()
 {
+    return Disk_InitSize(NUM_SECTORS);
+}
+
+/*
+ * Disk_InitSize
+ *
+ * Disk_Init for a disk of any number of sectors.
+ */
+int Disk_InitSize(int sectors)
+{
+    // pointers handed out by Disk_Get() would dangle
+    if (sectors <= 0 || pinnedSectors > 0) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    // drop whatever backed the disk before
+    Writeback_Drain();
+    Disk_Release();
+    if (Set_Size(sectors) == -1) {
+        return -1;
+    }
+
     // create the disk image and fill every sector with zeroes
-    disk = (Sector *) calloc(NUM_SECTORS, sizeof(Sector));
+    disk = (Sector *) calloc(numSectors, sizeof(Sector));
     if(disk == NULL) {
 	diskErrno = E_MEM_OP;
 	return -1;
@@ -30,20 +198,793 @@ int Disk_Init()
     return 0;
 }
 
+/*
+ * Disk_NumSectors
+ *
+ * How big the current disk is.
+ */
+int Disk_NumSectors()
+{
+    return numSectors;
+}
+
+/*
+ * Disk_Map
+ *
+ * Uses the image file itself as the disk instead of a copy in memory.
+ * The file is mmap'd shared, so reads and writes go straight to the page
+ * cache and nothing has to be read in up front. With DISK_MAP_PRIVATE it is
+ * mapped copy-on-write instead: still nothing is read in up front, but
+ * changes only reach the file when they are synced, as with Disk_Load().
+ * A brand new (empty) file is grown to sectors sectors (NUM_SECTORS if 0);
+ * an existing one keeps its size, which has to be a whole number of
+ * sectors. The other flags are DISK_MAP_* hints and are ignored where the
+ * kernel does not know them.
+ *
+ * Can be called instead of Disk_Init()/Disk_Load().
+ */
+int Disk_Map(char* file, int sectors, int flags)
+{
+    struct stat st;
+    unsigned long* newDirty;
+    unsigned short* newPins;
+    void* base;
+    size_t bytes;
+    int fd;
+
+    // error check (pointers handed out by Disk_Get() would dangle)
+    if (file == NULL || pinnedSectors > 0) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    if ((fd = open(file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) < 0) {
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+
+    // a fresh image reads back as all zeroes, same as Disk_Init()
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        diskErrno = E_READING_FILE;
+        return -1;
+    }
+    if (st.st_size == 0) {
+        bytes = (size_t) (sectors > 0 ? sectors : NUM_SECTORS) * sizeof(Sector);
+        if (ftruncate(fd, bytes) < 0) {
+            close(fd);
+            diskErrno = E_WRITING_FILE;
+            return -1;
+        }
+    } else {
+        bytes = (size_t) st.st_size;
+    }
+    if (bytes % sizeof(Sector) != 0 || bytes / sizeof(Sector) > 0x7fffffff) {
+        close(fd);
+        diskErrno = E_READING_FILE;
+        return -1;
+    }
+
+    base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, (flags & DISK_MAP_PRIVATE) ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        diskErrno = E_MAPPING_FILE;
+        return -1;
+    }
+
+    // the hints are best effort, a failure here is not an error
+#ifdef MADV_HUGEPAGE
+    if (flags & DISK_MAP_HUGEPAGE) {
+        madvise(base, bytes, MADV_HUGEPAGE);
+    }
+#endif
+    if (flags & DISK_MAP_WILLNEED) {
+        madvise(base, bytes, MADV_WILLNEED);
+    }
+    if (flags & DISK_MAP_RANDOM) {
+        madvise(base, bytes, MADV_RANDOM);
+    }
+
+    // the old disk stays as it is until nothing else can fail
+    if (New_Size((int) (bytes / sizeof(Sector)), &newDirty, &newPins) == -1) {
+        munmap(base, bytes);
+        close(fd);
+        return -1;
+    }
+    Writeback_Drain();
+    Disk_Release();
+    Use_Size((int) (bytes / sizeof(Sector)), newDirty, newPins);
+    disk = (Sector *) base;
+    diskMapped = 1;
+    diskShared = !(flags & DISK_MAP_PRIVATE);
+    diskFd = fd;
+    Set_Image(file);
+    return 0;
+}
+
+/*
+ * Next_Dirty_Run
+ *
+ * Finds the first dirty sector at or after "from" and how many dirty
+ * sectors follow it back to back. Returns -1 when there are none left.
+ */
+static int Next_Dirty_Run(int from, int* count)
+{
+    int w = from / DIRTY_WORD_BITS;
+    unsigned long word;
+    int start, end;
+
+    if (from >= numSectors) {
+        return -1;
+    }
+
+    // skip whole clean words at a time
+    word = dirty[w] & (~0UL << (from % DIRTY_WORD_BITS));
+    while (word == 0) {
+        if (++w == DIRTY_WORDS) {
+            return -1;
+        }
+        word = dirty[w];
+    }
+    start = w * DIRTY_WORD_BITS + __builtin_ctzl(word);
+
+    // then look for the first clean sector after it
+    word = ~dirty[w] & (~0UL << (start % DIRTY_WORD_BITS));
+    while (word == 0 && ++w < DIRTY_WORDS) {
+        word = ~dirty[w];
+    }
+    end = (w == DIRTY_WORDS) ? numSectors : w * DIRTY_WORD_BITS + __builtin_ctzl(word);
+    if (end > numSectors) {
+        end = numSectors;
+    }
+
+    *count = end - start;
+    return start;
+}
+
+/*
+ * Writeback engine
+ *
+ * A sync takes a snapshot of the dirty sectors (their data too, for an
+ * in-memory disk), marks them clean and hands them to background threads
+ * as a job, so the caller gets a ticket back straight away and can keep
+ * using the disk while older data drains to the image file. Jobs are
+ * written strictly one after another, so a newer copy of a sector can
+ * never be overwritten by an older one. The runs inside a job go out in
+ * parallel: as io_uring writes (or sync_file_range()s of a mapped image)
+ * from one thread when the kernel has io_uring, otherwise spread over a
+ * small pool of threads doing pwrite()/msync().
+ */
+#define WRITEBACK_THREADS 4      // pool size when there is no io_uring
+#define WRITEBACK_RING 64        // io_uring queue depth
+#define WRITEBACK_HISTORY 256    // finished tickets whose results are kept
+
+typedef struct writeback_run {
+    int sector;
+    int count;
+    char* data;              // snapshot of the sectors (NULL when mapped)
+} Writeback_Run;
+
+typedef struct writeback_job {
+    int ticket;
+    Writeback_Run* runs;
+    int nruns;
+    int nextRun;             // next run for a pool thread to take
+    int runsDone;
+    char* staging;           // holds every run's data
+    int fd;                  // image file
+    int mapped;
+    int failed;
+    Disk_Sync_Stats stats;
+    struct writeback_job* next;
+} Writeback_Job;
+
+static pthread_mutex_t wbLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wbWork = PTHREAD_COND_INITIALIZER;   // a job was queued
+static pthread_cond_t wbDone = PTHREAD_COND_INITIALIZER;   // a job finished
+static Writeback_Job* wbHead = NULL;
+static Writeback_Job* wbTail = NULL;
+static int wbStarted = 0;
+static int wbLastTicket = 0;     // last ticket handed out
+static int wbDoneTicket = 0;     // every ticket up to here is finished
+static Disk_Sync_Stats wbStats[WRITEBACK_HISTORY];
+static int wbFailed[WRITEBACK_HISTORY];
+
+// the io_uring, if the kernel has one for us
+static int ringFd = -1;
+static unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+static unsigned *cqHead, *cqTail, *cqMask;
+static struct io_uring_sqe* sqes;
+static struct io_uring_cqe* cqes;
+
+/*
+ * Ring_Setup
+ *
+ * Sets up an io_uring with raw system calls (no liburing needed). Returns
+ * -1 if the kernel doesn't have it or won't let us use it.
+ */
+static int Ring_Setup()
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    if ((fd = (int) syscall(__NR_io_uring_setup, WRITEBACK_RING, &p)) < 0) {
+        return -1;
+    }
+
+    sq = mmap(NULL, p.sq_off.array + p.sq_entries * sizeof(unsigned), PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq = mmap(NULL, p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe), PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    sqHead = (unsigned*) (sq + p.sq_off.head);
+    sqTail = (unsigned*) (sq + p.sq_off.tail);
+    sqMask = (unsigned*) (sq + p.sq_off.ring_mask);
+    sqArray = (unsigned*) (sq + p.sq_off.array);
+    cqHead = (unsigned*) (cq + p.cq_off.head);
+    cqTail = (unsigned*) (cq + p.cq_off.tail);
+    cqMask = (unsigned*) (cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+    ringFd = fd;
+    return 0;
+}
+
+/*
+ * Write_Run
+ *
+ * Writes one run of a job the plain, blocking way. Returns the number of
+ * write()/msync() calls it took, or -1.
+ */
+static int Write_Run(Writeback_Job* job, Writeback_Run* run)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start, end;
+    char* src;
+    size_t left;
+    off_t pos;
+
+    if (job->mapped) {
+        start = ((size_t) run->sector * sizeof(Sector)) / page * page;
+        end = (size_t) (run->sector + run->count) * sizeof(Sector);
+        return (msync((char*) disk + start, end - start, MS_SYNC) < 0) ? -1 : 1;
+    }
+
+    src = run->data;
+    left = (size_t) run->count * sizeof(Sector);
+    pos = (off_t) run->sector * sizeof(Sector);
+    while (left > 0) {
+        ssize_t n = pwrite(job->fd, src, left, pos);
+        if (n <= 0) {
+            return -1;
+        }
+        src += n;
+        pos += n;
+        left -= n;
+    }
+    return 1;
+}
+
+/*
+ * Finish_Job
+ *
+ * Records how a job went, takes it off the queue and wakes up anyone
+ * waiting on its ticket. Sectors of a failed job are marked dirty again so
+ * the next sync retries them. Called with wbLock held.
+ */
+static void Finish_Job(Writeback_Job* job)
+{
+    int i;
+
+    if (job->failed) {
+        pthread_mutex_lock(&diskLock);
+        for (i = 0; i < job->nruns; i++) {
+            Mark_Dirty_Range(job->runs[i].sector, job->runs[i].count);
+        }
+        pthread_mutex_unlock(&diskLock);
+    }
+
+    wbStats[job->ticket % WRITEBACK_HISTORY] = job->stats;
+    wbFailed[job->ticket % WRITEBACK_HISTORY] = job->failed;
+    wbDoneTicket = job->ticket;
+    wbHead = job->next;
+    if (wbHead == NULL) {
+        wbTail = NULL;
+    }
+    pthread_cond_broadcast(&wbDone);
+    pthread_cond_broadcast(&wbWork);
+
+    if (!job->mapped) {
+        close(job->fd);
+    }
+    free(job->staging);
+    free(job->runs);
+    free(job);
+}
+
+/*
+ * Pool_Thread
+ *
+ * Fallback writer: pool threads take the runs of the job at the head of
+ * the queue one at a time, and whoever finishes the last run finishes the
+ * job.
+ */
+static void* Pool_Thread(void* arg)
+{
+    Writeback_Job* job;
+    int i, writes;
+
+    pthread_mutex_lock(&wbLock);
+    for (;;) {
+        job = wbHead;
+        if (job != NULL && job->nruns == 0) {
+            Finish_Job(job);
+            continue;
+        }
+        if (job == NULL || job->nextRun == job->nruns) {
+            pthread_cond_wait(&wbWork, &wbLock);
+            continue;
+        }
+        i = job->nextRun++;
+        pthread_mutex_unlock(&wbLock);
+
+        writes = Write_Run(job, &job->runs[i]);
+
+        pthread_mutex_lock(&wbLock);
+        if (writes == -1) {
+            job->failed = 1;
+        } else {
+            job->stats.writes += writes;
+        }
+        if (++job->runsDone == job->nruns) {
+            Finish_Job(job);
+        }
+    }
+    return arg;
+}
+
+/*
+ * Ring_Thread
+ *
+ * io_uring writer: keeps up to WRITEBACK_RING runs of the job at the head
+ * of the queue in flight at once. A run the ring can't do (short write,
+ * an opcode the kernel doesn't know) is finished with Write_Run.
+ */
+static void* Ring_Thread(void* arg)
+{
+    Writeback_Job* job;
+    int submitted, completed, inFlight;
+
+    for (;;) {
+        pthread_mutex_lock(&wbLock);
+        while ((job = wbHead) == NULL) {
+            pthread_cond_wait(&wbWork, &wbLock);
+        }
+        pthread_mutex_unlock(&wbLock);
+
+        submitted = completed = inFlight = 0;
+        while (completed < job->nruns) {
+            unsigned head, tail, pending;
+
+            // queue as many runs as fit
+            tail = *sqTail;
+            while (submitted < job->nruns && inFlight < WRITEBACK_RING) {
+                Writeback_Run* run = &job->runs[submitted];
+                unsigned idx = tail & *sqMask;
+                struct io_uring_sqe* sqe = &sqes[idx];
+
+                memset(sqe, 0, sizeof(*sqe));
+                sqe->fd = job->fd;
+                sqe->off = (unsigned long long) run->sector * sizeof(Sector);
+                sqe->len = (unsigned) (run->count * sizeof(Sector));
+                sqe->user_data = (unsigned long long) submitted;
+                if (job->mapped) {
+                    sqe->opcode = IORING_OP_SYNC_FILE_RANGE;
+                    sqe->sync_range_flags = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                            SYNC_FILE_RANGE_WAIT_AFTER;
+                } else {
+                    sqe->opcode = IORING_OP_WRITE;
+                    sqe->addr = (unsigned long long) (uintptr_t) run->data;
+                }
+                sqArray[idx] = idx;
+                tail++;
+                submitted++;
+                inFlight++;
+            }
+            __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+            pending = tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            if (syscall(__NR_io_uring_enter, ringFd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                errno != EINTR) {
+                // the ring is broken: take back what it didn't pick up and
+                // finish the job the plain way
+                pending = tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+                __atomic_store_n(sqTail, tail - pending, __ATOMIC_RELEASE);
+                inFlight -= pending;
+                for (submitted -= pending; submitted < job->nruns; submitted++) {
+                    if (Write_Run(job, &job->runs[submitted]) == -1) {
+                        job->failed = 1;
+                    }
+                    job->stats.writes++;
+                    completed++;
+                }
+            }
+
+            // reap whatever has completed
+            head = *cqHead;
+            while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe* cqe = &cqes[head & *cqMask];
+                Writeback_Run* run = &job->runs[cqe->user_data];
+
+                if (cqe->res < 0 || (!job->mapped && cqe->res != run->count * (int) sizeof(Sector))) {
+                    if (Write_Run(job, run) == -1) {
+                        job->failed = 1;
+                    }
+                }
+                job->stats.writes++;
+                head++;
+                completed++;
+                inFlight--;
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        }
+
+        pthread_mutex_lock(&wbLock);
+        Finish_Job(job);
+        pthread_mutex_unlock(&wbLock);
+    }
+    return arg;
+}
+
+/*
+ * Writeback_Start
+ *
+ * Starts the writeback threads the first time they are needed. Called with
+ * wbLock held.
+ */
+static int Writeback_Start()
+{
+    pthread_t thread;
+    int i, started = 0;
+
+    if (wbStarted) {
+        return 0;
+    }
+    if (Ring_Setup() == 0 && pthread_create(&thread, NULL, Ring_Thread, NULL) == 0) {
+        pthread_detach(thread);
+        wbStarted = 1;
+        return 0;
+    }
+    if (ringFd != -1) {
+        close(ringFd);
+        ringFd = -1;
+    }
+
+    for (i = 0; i < WRITEBACK_THREADS; i++) {
+        if (pthread_create(&thread, NULL, Pool_Thread, NULL) == 0) {
+            pthread_detach(thread);
+            started++;
+        }
+    }
+    wbStarted = (started > 0);
+    return wbStarted ? 0 : -1;
+}
+
+/*
+ * Writeback_Drain
+ *
+ * Waits for every job handed out so far, before the disk goes away or is
+ * swapped for another one.
+ */
+static void Writeback_Drain()
+{
+    pthread_mutex_lock(&wbLock);
+    while (wbDoneTicket != wbLastTicket) {
+        pthread_cond_wait(&wbDone, &wbLock);
+    }
+    pthread_mutex_unlock(&wbLock);
+}
+
+/*
+ * Writeback_Drain_Range
+ *
+ * Waits only for the jobs holding a copy of any of count sectors from
+ * sector on, so that they can't land on top of a newer write. Jobs of a
+ * mapped image hold no copy, they write whatever the disk has by then.
+ */
+static void Writeback_Drain_Range(int sector, int count)
+{
+    Writeback_Job* job;
+    int i, busy;
+
+    pthread_mutex_lock(&wbLock);
+    do {
+        busy = 0;
+        for (job = wbHead; job != NULL && !busy; job = job->next) {
+            // runs are in sector order
+            for (i = 0; !job->mapped && i < job->nruns && job->runs[i].sector < sector + count; i++) {
+                if (job->runs[i].sector + job->runs[i].count > sector) {
+                    busy = 1;
+                    break;
+                }
+            }
+        }
+        if (busy) {
+            pthread_cond_wait(&wbDone, &wbLock);
+        }
+    } while (busy);
+    pthread_mutex_unlock(&wbLock);
+}
+
+/*
+ * Snapshot_Job
+ *
+ * Collects the dirty sectors into a job and marks them clean. For a
+ * mapped image runs sharing a page are merged (the page is what gets
+ * written); for an in-memory one the data is copied out, so later writes
+ * don't race the job. Called with diskLock held.
+ */
+static Writeback_Job* Snapshot_Job()
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    Writeback_Job* job;
+    int sector, count, total = 0, max = 0;
+    char* dst;
+
+    if ((job = calloc(1, sizeof(Writeback_Job))) == NULL) {
+        return NULL;
+    }
+    job->mapped = diskShared;
+
+    // size things up first
+    for (sector = 0; (sector = Next_Dirty_Run(sector, &count)) != -1; sector += count) {
+        total += count;
+        max++;
+    }
+    job->runs = calloc(max > 0 ? max : 1, sizeof(Writeback_Run));
+    job->staging = job->mapped ? NULL : malloc(total > 0 ? (size_t) total * sizeof(Sector) : 1);
+    if (job->runs == NULL || (!job->mapped && job->staging == NULL)) {
+        free(job->runs);
+        free(job->staging);
+        free(job);
+        return NULL;
+    }
+
+    dst = job->staging;
+    for (sector = 0; (sector = Next_Dirty_Run(sector, &count)) != -1; sector += count) {
+        Writeback_Run* last = (job->nruns > 0) ? &job->runs[job->nruns - 1] : NULL;
+
+        job->stats.sectors += count;
+        if (job->mapped) {
+            size_t start = ((size_t) sector * sizeof(Sector)) / page * page;
+            if (last != NULL && start <= (size_t) (last->sector + last->count) * sizeof(Sector)) {
+                last->count = sector + count - last->sector;
+                continue;
+            }
+        } else {
+            memcpy(dst, disk + sector, (size_t) count * sizeof(Sector));
+            job->runs[job->nruns].data = dst;
+            dst += (size_t) count * sizeof(Sector);
+        }
+        job->runs[job->nruns].sector = sector;
+        job->runs[job->nruns].count = count;
+        job->nruns++;
+    }
+    for (count = 0; count < job->nruns; count++) {
+        Writeback_Run* run = &job->runs[count];
+        if (job->mapped) {
+            // msync()/sync_file_range() start on a page boundary
+            size_t start = ((size_t) run->sector * sizeof(Sector)) / page * page;
+            job->stats.bytes += (long) ((size_t) (run->sector + run->count) * sizeof(Sector) - start);
+        } else {
+            job->stats.bytes += (long) run->count * sizeof(Sector);
+        }
+    }
+
+    memset(dirty, 0, DIRTY_WORDS * sizeof(unsigned long));
+    return job;
+}
+
+/*
+ * Disk_SyncStart
+ *
+ * Starts bringing the image file up to date in the background (see the
+ * writeback engine above) and returns a ticket to hand to Disk_SyncWait
+ * or Disk_SyncPoll. If file is not the disk's own image there is nothing
+ * to be incremental against, so the whole disk is saved to it before this
+ * returns (the ticket is already finished).
+ */
+int Disk_SyncStart(char* file)
+{
+    Writeback_Job* job;
+    int ticket;
+
+    // error check
+    if (file == NULL || disk == NULL) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    pthread_mutex_lock(&wbLock);
+    if (Writeback_Start() == -1) {
+        pthread_mutex_unlock(&wbLock);
+        diskErrno = E_MEM_OP;
+        return -1;
+    }
+    pthread_mutex_unlock(&wbLock);
+
+    if (diskPath == NULL || strcmp(file, diskPath) != 0) {
+        Writeback_Drain();
+        if (Disk_Save_Image(file) == -1) {
+            return -1;
+        }
+
+        // an in-memory disk now matches the file it was saved to
+        if (!diskShared) {
+            Set_Image(file);
+        }
+
+        pthread_mutex_lock(&wbLock);
+        ticket = ++wbLastTicket;
+        wbStats[ticket % WRITEBACK_HISTORY].sectors = numSectors;
+        wbStats[ticket % WRITEBACK_HISTORY].bytes = (long) DISK_BYTES;
+        wbStats[ticket % WRITEBACK_HISTORY].writes = 1;
+        wbFailed[ticket % WRITEBACK_HISTORY] = 0;
+        wbDoneTicket = ticket;
+        pthread_mutex_unlock(&wbLock);
+        return ticket;
+    }
+
+    // the snapshot and the ticket have to be in the same order
+    pthread_mutex_lock(&wbLock);
+    pthread_mutex_lock(&diskLock);
+    job = Snapshot_Job();
+    pthread_mutex_unlock(&diskLock);
+    if (job == NULL) {
+        pthread_mutex_unlock(&wbLock);
+        diskErrno = E_MEM_OP;
+        return -1;
+    }
+
+    if ((job->fd = job->mapped ? diskFd : open(diskPath, O_WRONLY)) < 0) {
+        // put it all back for the next try
+        pthread_mutex_lock(&diskLock);
+        for (ticket = 0; ticket < job->nruns; ticket++) {
+            Mark_Dirty_Range(job->runs[ticket].sector, job->runs[ticket].count);
+        }
+        pthread_mutex_unlock(&diskLock);
+        pthread_mutex_unlock(&wbLock);
+        free(job->staging);
+        free(job->runs);
+        free(job);
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+
+    // even an empty job is queued, it is only done once the ones before are
+    job->ticket = ticket = ++wbLastTicket;
+    if (wbTail == NULL) {
+        wbHead = job;
+    } else {
+        wbTail->next = job;
+    }
+    wbTail = job;
+    pthread_cond_broadcast(&wbWork);
+    pthread_mutex_unlock(&wbLock);
+    return ticket;
+}
+
+/*
+ * Disk_SyncPoll
+ *
+ * 1 if the sync with this ticket is done, 0 if it is still being written
+ * and -1 if writing it failed (its sectors will go out with the next sync).
+ */
+int Disk_SyncPoll(int ticket)
+{
+    int ret;
+
+    pthread_mutex_lock(&wbLock);
+    if (ticket <= 0 || ticket > wbLastTicket) {
+        diskErrno = E_INVALID_PARAM;
+        ret = -1;
+    } else if (ticket > wbDoneTicket) {
+        ret = 0;
+    } else if (wbLastTicket - ticket < WRITEBACK_HISTORY && wbFailed[ticket % WRITEBACK_HISTORY]) {
+        diskErrno = E_WRITING_FILE;
+        ret = -1;
+    } else {
+        ret = 1;
+    }
+    pthread_mutex_unlock(&wbLock);
+    return ret;
+}
+
+/*
+ * Disk_SyncWait
+ *
+ * Blocks until the sync with this ticket (and every one before it) is on
+ * the image file. What it wrote is reported through stats (may be NULL;
+ * zeroes once the ticket is too old to remember).
+ */
+int Disk_SyncWait(int ticket, Disk_Sync_Stats* stats)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&wbLock);
+    if (ticket <= 0 || ticket > wbLastTicket) {
+        pthread_mutex_unlock(&wbLock);
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    while (wbDoneTicket < ticket) {
+        pthread_cond_wait(&wbDone, &wbLock);
+    }
+    if (stats != NULL) {
+        memset(stats, 0, sizeof(Disk_Sync_Stats));
+    }
+    if (wbLastTicket - ticket < WRITEBACK_HISTORY) {
+        if (stats != NULL) {
+            *stats = wbStats[ticket % WRITEBACK_HISTORY];
+        }
+        if (wbFailed[ticket % WRITEBACK_HISTORY]) {
+            diskErrno = E_WRITING_FILE;
+            ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&wbLock);
+    return ret;
+}
+
+/*
+ * Disk_SyncDirty
+ *
+ * Brings the image file up to date by writing out only the sectors that
+ * changed since it was mapped, loaded or last saved, and waits for it.
+ * Adjacent dirty sectors go out as one write. If file is not the disk's
+ * own image the whole disk is saved to it. What was written is reported
+ * through stats (may be NULL).
+ */
+int Disk_SyncDirty(char* file, Disk_Sync_Stats* stats)
+{
+    int ticket;
+
+    if (stats != NULL) {
+        memset(stats, 0, sizeof(Disk_Sync_Stats));
+    }
+    if ((ticket = Disk_SyncStart(file)) == -1) {
+        return -1;
+    }
+    return Disk_SyncWait(ticket, stats);
+}
+
 /*
  * Disk_Save
  *
  * Makes sure the current disk image gets saved to memory - this
  * will overwrite an existing file with the same name so be careful
+ *
+ * Saving back to the disk's own image only writes the dirty sectors
+ * (see Disk_SyncDirty).
  */
 int Disk_Save(char* file) {
-    FILE* diskFile;
-    
-    // error check
-    if (file == NULL) {
-	diskErrno = E_INVALID_PARAM;
-	return -1;
-    }
+    return Disk_SyncDirty(file, NULL);
+}
+
+/*
+ * Disk_Save_Image
+ *
+ * Writes every sector of the disk to file.
+ */
+static int Disk_Save_Image(char* file) {
+    FILE* diskFile;
     
     // open the diskFile
     if ((diskFile = fopen(file, "w")) == NULL) {
@@ -52,7 +993,7 @@ int Disk_Save(char* file) {
     }
     
     // actually write the disk image to a file
-    if ((fwrite(disk, sizeof(Sector), NUM_SECTORS, diskFile)) != NUM_SECTORS) {
+    if ((fwrite(disk, sizeof(Sector), numSectors, diskFile)) != (size_t) numSectors) {
 	fclose(diskFile);
 	diskErrno = E_WRITING_FILE;
 	return -1;
@@ -78,6 +1019,13 @@ int Disk_Load(char* file) {
         printf("The file is null.\n");
 	    return -1;
     }
+
+    // a mapped disk already is the file
+    if (diskMapped) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    Writeback_Drain();
     
     // open the diskFile
     if ((diskFile = fopen(file, "r")) == NULL) {
@@ -87,7 +1035,7 @@ int Disk_Load(char* file) {
     }
     
     // actually read the disk image into memory
-    if ((fread(disk, sizeof(Sector), NUM_SECTORS, diskFile)) != NUM_SECTORS) {
+    if ((fread(disk, sizeof(Sector), numSectors, diskFile)) != (size_t) numSectors) {
 	fclose(diskFile);
 	diskErrno = E_READING_FILE;
         printf("The read was unsuccesful\n");
@@ -96,6 +1044,7 @@ int Disk_Load(char* file) {
     
     // clean up and return
     fclose(diskFile);
+    Set_Image(file);
     return 0;
 }
 
@@ -107,7 +1056,7 @@ int Disk_Load(char* file) {
  */
 int Disk_Read(int sector, char* buffer) {
     // quick error checks
-    if ((sector < 0) || (sector >= NUM_SECTORS) || (buffer == NULL)) {
+    if ((sector < 0) || (sector >= numSectors) || (buffer == NULL)) {
 	diskErrno = E_INVALID_PARAM;
 	return -1;
     }
@@ -117,6 +1066,7 @@ int Disk_Read(int sector, char* buffer) {
 	diskErrno = E_MEM_OP;
 	return -1;
     }
+    ACCESS_READ(sector, 1);
     
     return 0;
 }
@@ -129,7 +1079,7 @@ int Disk_Read(int sector, char* buffer) {
 int Disk_Write(int sector, char* buffer) 
 {
     // quick error checks
-    if((sector < 0) || (sector >= NUM_SECTORS) || (buffer == NULL)) {
+    if((sector < 0) || (sector >= numSectors) || (buffer == NULL)) {
 	diskErrno = E_INVALID_PARAM;
 	return -1;
     }
@@ -139,6 +1089,686 @@ int Disk_Write(int sector, char* buffer)
 	diskErrno = E_MEM_OP;
 	return -1;
     }
+
+    pthread_mutex_lock(&diskLock);
+    dirty[sector / DIRTY_WORD_BITS] |= 1UL << (sector % DIRTY_WORD_BITS);
+    pthread_mutex_unlock(&diskLock);
+    ACCESS_WRITE(sector, 1);
+    return 0;
+}
+
+/*
+ * Mark_Dirty_Range
+ *
+ * Sets the dirty bits of count sectors from sector on. The caller holds
+ * diskLock.
+ */
+static void Mark_Dirty_Range(int sector, int count)
+{
+    while (count > 0) {
+        int bit = sector % DIRTY_WORD_BITS;
+        int n = DIRTY_WORD_BITS - bit;
+        unsigned long mask;
+
+        if (n > count) {
+            n = count;
+        }
+        mask = (n == DIRTY_WORD_BITS) ? ~0UL : ((1UL << n) - 1) << bit;
+        dirty[sector / DIRTY_WORD_BITS] |= mask;
+        sector += n;
+        count -= n;
+    }
+}
+
+/*
+ * Disk_ReadV
+ *
+ * Reads count contiguous sectors starting at sector into buffer with a
+ * single copy.
+ */
+int Disk_ReadV(int sector, int count, char* buffer)
+{
+    // quick error checks
+    if ((sector < 0) || (count < 0) || (sector + count > numSectors) || (buffer == NULL)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    memcpy((void*)buffer, (void*)(disk + sector), (size_t) count * sizeof(Sector));
+    ACCESS_READ(sector, count);
+    return 0;
+}
+
+/*
+ * Disk_WriteV
+ *
+ * Writes count contiguous sectors starting at sector from buffer with a
+ * single copy.
+ */
+int Disk_WriteV(int sector, int count, char* buffer)
+{
+    // quick error checks
+    if ((sector < 0) || (count < 0) || (sector + count > numSectors) || (buffer == NULL)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    memcpy((void*)(disk + sector), (void*)buffer, (size_t) count * sizeof(Sector));
+    pthread_mutex_lock(&diskLock);
+    Mark_Dirty_Range(sector, count);
+    pthread_mutex_unlock(&diskLock);
+    ACCESS_WRITE(sector, count);
+    return 0;
+}
+
+/*
+ * Disk_WriteThrough
+ *
+ * Writes count contiguous sectors from buffer to the disk and straight on
+ * to its image file, returning only once they are stable there. Meant for
+ * small appends that have to be durable right away (a journal commit), so
+ * the sectors are not left dirty for the next sync. Fails if the disk has
+ * no image file yet.
+ */
+int Disk_WriteThrough(int sector, int count, char* buffer)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start, end, left;
+    char* src = buffer;
+    off_t pos;
+    int fd;
+
+    // quick error checks
+    if ((sector < 0) || (count < 0) || (sector + count > numSectors) || (buffer == NULL)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    if (diskPath == NULL) {
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+
+    // a queued writeback may hold an older copy of these sectors and must
+    // not land on top of this write (the others can go on draining)
+    Writeback_Drain_Range(sector, count);
+
+    memcpy((void*)(disk + sector), (void*)buffer, (size_t) count * sizeof(Sector));
+    ACCESS_WRITE(sector, count);
+
+    if (diskShared) {
+        start = ((size_t) sector * sizeof(Sector)) / page * page;
+        end = (size_t) (sector + count) * sizeof(Sector);
+        if (msync((char*) disk + start, end - start, MS_SYNC) < 0) {
+            diskErrno = E_WRITING_FILE;
+            return -1;
+        }
+        return 0;
+    }
+
+    if ((fd = open(diskPath, O_WRONLY)) < 0) {
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+    left = (size_t) count * sizeof(Sector);
+    pos = (off_t) sector * sizeof(Sector);
+    while (left > 0) {
+        ssize_t n = pwrite(fd, src, left, pos);
+        if (n <= 0) {
+            close(fd);
+            diskErrno = E_WRITING_FILE;
+            return -1;
+        }
+        src += n;
+        pos += n;
+        left -= n;
+    }
+    if (fdatasync(fd) < 0) {
+        close(fd);
+        diskErrno = E_WRITING_FILE;
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * Disk_ReadIOV
+ *
+ * Scatter read: each entry is a run of contiguous sectors and the buffer
+ * it goes to. Every entry is checked before anything is copied.
+ */
+int Disk_ReadIOV(Disk_IOVec* iov, int iovcnt)
+{
+    int i;
+
+    if (iov == NULL || iovcnt < 0) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    for (i = 0; i < iovcnt; i++) {
+        if ((iov[i].sector < 0) || (iov[i].count < 0) ||
+            (iov[i].sector + iov[i].count > numSectors) || (iov[i].buffer == NULL)) {
+            diskErrno = E_INVALID_PARAM;
+            return -1;
+        }
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        memcpy((void*)iov[i].buffer, (void*)(disk + iov[i].sector), (size_t) iov[i].count * sizeof(Sector));
+        ACCESS_READ(iov[i].sector, iov[i].count);
+    }
+    return 0;
+}
+
+/*
+ * Disk_WriteIOV
+ *
+ * Gather write: each entry is a run of contiguous sectors and the buffer
+ * it comes from. Every entry is checked before anything is copied.
+ */
+int Disk_WriteIOV(Disk_IOVec* iov, int iovcnt)
+{
+    int i;
+
+    if (iov == NULL || iovcnt < 0) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    for (i = 0; i < iovcnt; i++) {
+        if ((iov[i].sector < 0) || (iov[i].count < 0) ||
+            (iov[i].sector + iov[i].count > numSectors) || (iov[i].buffer == NULL)) {
+            diskErrno = E_INVALID_PARAM;
+            return -1;
+        }
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        memcpy((void*)(disk + iov[i].sector), (void*)iov[i].buffer, (size_t) iov[i].count * sizeof(Sector));
+        ACCESS_WRITE(iov[i].sector, iov[i].count);
+    }
+    pthread_mutex_lock(&diskLock);
+    for (i = 0; i < iovcnt; i++) {
+        Mark_Dirty_Range(iov[i].sector, iov[i].count);
+    }
+    pthread_mutex_unlock(&diskLock);
+    return 0;
+}
+
+/*
+ * Disk_Get
+ *
+ * Pins a single sector and hands back a pointer straight into the disk,
+ * so the caller can look at or change it in place instead of copying it
+ * through a buffer. The pointer stays good until the matching Disk_Put.
+ * Changes made through it only count as writes once the sector is marked
+ * dirty (Disk_Put(sector, 1) or Disk_MarkDirty).
+ */
+char* Disk_Get(int sector)
+{
+    // quick error checks
+    if ((sector < 0) || (sector >= numSectors) || (disk == NULL)) {
+        diskErrno = E_INVALID_PARAM;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&diskLock);
+    if (pins[sector]++ == 0) {
+        pinnedSectors++;
+    }
+    pthread_mutex_unlock(&diskLock);
+    ACCESS_READ(sector, 1);
+    return (char*) (disk + sector);
+}
+
+/*
+ * Disk_Put
+ *
+ * Unpins a sector handed out by Disk_Get. A nonzero isDirty means the
+ * caller changed it.
+ */
+int Disk_Put(int sector, int isDirty)
+{
+    // quick error checks
+    if ((sector < 0) || (sector >= numSectors)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    pthread_mutex_lock(&diskLock);
+    if (pins[sector] == 0) {
+        pthread_mutex_unlock(&diskLock);
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    if (--pins[sector] == 0) {
+        pinnedSectors--;
+    }
+    if (isDirty) {
+        dirty[sector / DIRTY_WORD_BITS] |= 1UL << (sector % DIRTY_WORD_BITS);
+    }
+    pthread_mutex_unlock(&diskLock);
+
+    // the timing model may sleep, so not while other threads wait on diskLock
+    if (isDirty) {
+        ACCESS_WRITE(sector, 1);
+    }
+    return 0;
+}
+
+/*
+ * Disk_GetV
+ *
+ * Disk_Get for count contiguous sectors: pins all of them and returns a
+ * pointer to the first, the rest follow it in memory.
+ */
+char* Disk_GetV(int sector, int count)
+{
+    int i;
+
+    // quick error checks
+    if ((sector < 0) || (count <= 0) || (sector + count > numSectors) || (disk == NULL)) {
+        diskErrno = E_INVALID_PARAM;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&diskLock);
+    for (i = sector; i < sector + count; i++) {
+        if (pins[i]++ == 0) {
+            pinnedSectors++;
+        }
+    }
+    pthread_mutex_unlock(&diskLock);
+    ACCESS_READ(sector, count);
+    return (char*) (disk + sector);
+}
+
+/*
+ * Disk_PutV
+ *
+ * Unpins count contiguous sectors handed out by Disk_GetV.
+ */
+int Disk_PutV(int sector, int count, int isDirty)
+{
+    int i;
+
+    // quick error checks
+    if ((sector < 0) || (count <= 0) || (sector + count > numSectors)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    pthread_mutex_lock(&diskLock);
+    for (i = sector; i < sector + count; i++) {
+        if (pins[i] == 0) {
+            pthread_mutex_unlock(&diskLock);
+            diskErrno = E_INVALID_PARAM;
+            return -1;
+        }
+    }
+
+    for (i = sector; i < sector + count; i++) {
+        if (--pins[i] == 0) {
+            pinnedSectors--;
+        }
+    }
+    if (isDirty) {
+        Mark_Dirty_Range(sector, count);
+    }
+    pthread_mutex_unlock(&diskLock);
+    if (isDirty) {
+        ACCESS_WRITE(sector, count);
+    }
+    return 0;
+}
+
+/*
+ * Disk_MarkDirty
+ *
+ * Records that a pinned sector was changed in place, without unpinning it.
+ */
+int Disk_MarkDirty(int sector)
+{
+    // quick error checks
+    if ((sector < 0) || (sector >= numSectors)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    pthread_mutex_lock(&diskLock);
+    if (pins[sector] == 0) {
+        pthread_mutex_unlock(&diskLock);
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    dirty[sector / DIRTY_WORD_BITS] |= 1UL << (sector % DIRTY_WORD_BITS);
+    pthread_mutex_unlock(&diskLock);
+    ACCESS_WRITE(sector, 1);
+    return 0;
+}
+
+/*
+ * Disk_SetRegions
+ *
+ * Splits the disk into count spans for the per-region counts: span i
+ * starts at sector first[i] (first[0] is 0, and they have to go up), runs
+ * to the start of the next and counts toward region region[i]. A span can
+ * be empty.
+ */
+int Disk_SetRegions(int* first, int* region, int count)
+{
+    int i;
+
+    // error check
+    if (first == NULL || region == NULL || count <= 0 || count > DISK_MAX_SPANS || first[0] != 0) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if ((i > 0 && first[i] < first[i - 1]) || region[i] < 0 || region[i] >= DISK_MAX_REGIONS) {
+            diskErrno = E_INVALID_PARAM;
+            return -1;
+        }
+    }
+
+#ifdef FS_STATS
+    memcpy(spanFirst, first, count * sizeof(int));
+    memcpy(spanRegion, region, count * sizeof(int));
+    numSpans = count;
+#endif
+    return 0;
+}
+
+/*
+ * Disk_GetStats
+ *
+ * Copies out the counts so far. Fails (and zeroes stats) unless the
+ * library was built with FS_STATS.
+ */
+int Disk_GetStats(Disk_Stats* stats_out)
+{
+    // error check
+    if (stats_out == NULL) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+#ifdef FS_STATS
+    long* from = (long*) &stats;
+    long* to = (long*) stats_out;
+    size_t i;
+
+    for (i = 0; i < sizeof(Disk_Stats) / sizeof(long); i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+    return 0;
+#else
+    memset(stats_out, 0, sizeof(Disk_Stats));
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+#endif
+}
+
+/*
+ * Disk_ResetStats
+ *
+ * Starts the counts over from zero.
+ */
+void Disk_ResetStats()
+{
+#ifdef FS_STATS
+    long* counts = (long*) &stats;
+    size_t i;
+
+    for (i = 0; i < sizeof(Disk_Stats) / sizeof(long); i++) {
+        __atomic_store_n(&counts[i], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&lastSector, 0, __ATOMIC_RELAXED);
+#endif
+}
+
+#ifdef FS_STATS
+/*
+ * Count_Access
+ *
+ * Counts an access to count sectors from sector on: as reads or writes,
+ * split over the regions they fall in, and as a seek if it doesn't start
+ * where the one before ended.
+ */
+static void Count_Access(int sector, int count, int isWrite)
+{
+    long* region = isWrite ? stats.region_writes : stats.region_reads;
+    int last = __atomic_exchange_n(&lastSector, sector + count, __ATOMIC_RELAXED);
+    int i, j, lo, hi;
+
+    __atomic_fetch_add(isWrite ? &stats.writes : &stats.reads, count, __ATOMIC_RELAXED);
+    if (numSpans == 0) {
+        __atomic_fetch_add(&region[0], count, __ATOMIC_RELAXED);
+    }
+
+    // the last span starting at or before sector, then on through the ones the access covers
+    for (lo = 0, hi = numSpans - 1; lo < hi; ) {
+        j = (lo + hi + 1) / 2;
+        if (spanFirst[j] <= sector) {
+            lo = j;
+        } else {
+            hi = j - 1;
+        }
+    }
+    for (i = lo; i < numSpans && spanFirst[i] < sector + count; i++) {
+        lo = (sector > spanFirst[i]) ? sector : spanFirst[i];
+        hi = sector + count;
+        if (i + 1 < numSpans && hi > spanFirst[i + 1]) {
+            hi = spanFirst[i + 1];
+        }
+        if (hi > lo) {
+            __atomic_fetch_add(&region[spanRegion[i]], hi - lo, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (last != sector) {
+        __atomic_fetch_add(&stats.seeks, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.seek_distance, (long) abs(sector - last), __ATOMIC_RELAXED);
+    }
+}
+#endif
+
+
+/*
+ * Disk_DefaultModel
+ *
+ * Fills in model with typical numbers for a type: a 7200 rpm drive with
+ * about 60 MB/s on a track and 0.5 to 12 ms seeks, or an 8 channel SSD
+ * with 4K pages, 50 us reads and 200 us programs. Change any of them
+ * before Disk_SetModel().
+ */
+int Disk_DefaultModel(int type, Disk_Model* model)
+{
+    // error check
+    if (model == NULL) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    memset(model, 0, sizeof(Disk_Model));
+    model->type = type;
+    switch (type) {
+    case DISK_MODEL_NONE:
+        break;
+    case DISK_MODEL_HDD:
+        model->rpm = 7200;
+        model->sectors_per_track = 1000;
+        model->seek_min_us = 500;
+        model->seek_max_us = 12000;
+        break;
+    case DISK_MODEL_SSD:
+        model->channels = 8;
+        model->page_sectors = 8;
+        model->read_us = 50;
+        model->write_us = 200;
+        break;
+    default:
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Disk_SetModel
+ *
+ * From now on every read and write (copied, pinned or marked dirty) adds
+ * what it would take on the modelled disk to the simulated time. NULL or
+ * DISK_MODEL_NONE turns timing off. The head starts at sector 0 and the
+ * channels idle; the simulated time carries on. Set it before threads
+ * start using the disk.
+ */
+int Disk_SetModel(Disk_Model* newModel)
+{
+    Disk_Model none = { .type = DISK_MODEL_NONE };
+
+    if (newModel == NULL) {
+        newModel = &none;
+    }
+
+    // error check
+    if ((newModel->type == DISK_MODEL_HDD &&
+         (newModel->rpm <= 0 || newModel->sectors_per_track <= 0 ||
+          newModel->seek_min_us < 0 || newModel->seek_max_us < newModel->seek_min_us)) ||
+        (newModel->type == DISK_MODEL_SSD &&
+         (newModel->channels <= 0 || newModel->channels > DISK_MAX_CHANNELS ||
+          newModel->page_sectors <= 0 || newModel->read_us < 0 || newModel->write_us < 0)) ||
+        newModel->type < DISK_MODEL_NONE || newModel->type > DISK_MODEL_SSD) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    pthread_mutex_lock(&modelLock);
+    model = *newModel;
+    headSector = 0;
+    memset(channelBusy, 0, sizeof(channelBusy));
+    pthread_mutex_unlock(&modelLock);
     return 0;
 }
 
+/*
+ * Disk_SimTime
+ *
+ * Simulated nanoseconds the accesses since the last Disk_ResetSimTime()
+ * took, one after the other.
+ */
+long Disk_SimTime()
+{
+    long t;
+
+    pthread_mutex_lock(&modelLock);
+    t = simTime;
+    pthread_mutex_unlock(&modelLock);
+    return t;
+}
+
+void Disk_ResetSimTime()
+{
+    pthread_mutex_lock(&modelLock);
+    simTime = 0;
+    memset(channelBusy, 0, sizeof(channelBusy));
+    pthread_mutex_unlock(&modelLock);
+}
+
+/*
+ * Isqrt
+ *
+ * Integer square root (rounded down), for the seek curve.
+ */
+static long Isqrt(long n)
+{
+    long x = n, y = (n + 1) / 2;
+
+    while (y < x) {
+        x = y;
+        y = (x + n / x) / 2;
+    }
+    return x;
+}
+
+/*
+ * Hdd_Time
+ *
+ * One head over a single surface: seek to the sector's cylinder (none if
+ * it is on the one the head is over), wait for the sector to come round,
+ * then transfer at a track's worth per revolution. An access starting
+ * where the last one ended costs only the transfer. The caller holds
+ * modelLock.
+ */
+static long Hdd_Time(int sector, int count)
+{
+    long rotation = 60000000000L / model.rpm;
+    long perSector = rotation / model.sectors_per_track;
+    long cylinders = (numSectors + model.sectors_per_track - 1) / model.sectors_per_track;
+    long distance = labs((long) (sector / model.sectors_per_track) - headSector / model.sectors_per_track);
+    long t = 0, angle;
+
+    if (sector != headSector) {
+        if (distance > 0) {
+            t = (model.seek_min_us + (model.seek_max_us - model.seek_min_us) *
+                 Isqrt(distance * 1000000 / cylinders) / 1000) * 1000L;
+        }
+
+        // the platter keeps turning while the head seeks
+        angle = ((simTime + t) / perSector) % model.sectors_per_track;
+        t += ((sector % model.sectors_per_track) - angle + model.sectors_per_track) %
+             model.sectors_per_track * perSector;
+    }
+    headSector = sector + count;
+    return t + count * perSector;
+}
+
+/*
+ * Ssd_Time
+ *
+ * Each page the access touches goes to its channel, which takes it as soon
+ * as it is done with the one before; the access is over when its last
+ * page is. The caller holds modelLock.
+ */
+static long Ssd_Time(int sector, int count, int isWrite)
+{
+    long latency = (isWrite ? model.write_us : model.read_us) * 1000L;
+    long end = simTime;
+    int page;
+
+    for (page = sector / model.page_sectors; page <= (sector + count - 1) / model.page_sectors; page++) {
+        long* busy = &channelBusy[page % model.channels];
+        *busy = ((*busy > simTime) ? *busy : simTime) + latency;
+        if (*busy > end) {
+            end = *busy;
+        }
+    }
+    return end - simTime;
+}
+
+/*
+ * Time_Access
+ *
+ * Adds an access to count sectors from sector on to the simulated time,
+ * and sleeps it off if the model says to.
+ */
+static void Time_Access(int sector, int count, int isWrite)
+{
+    struct timespec ts;
+    long t = 0;
+    int sleep;
+
+    pthread_mutex_lock(&modelLock);
+    if (model.type == DISK_MODEL_HDD) {
+        t = Hdd_Time(sector, count);
+    } else if (model.type == DISK_MODEL_SSD) {
+        t = Ssd_Time(sector, count, isWrite);
+    }
+    simTime += t;
+    sleep = model.sleep;
+    pthread_mutex_unlock(&modelLock);
+
+    if (sleep && t > 0) {
+        ts.tv_sec = t / 1000000000L;
+        ts.tv_nsec = t % 1000000000L;
+        nanosleep(&ts, NULL);
+    }
+}
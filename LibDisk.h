@@ -1,8 +1,9 @@
 //
 // Disk.h
 //
-// Emulates a very simple disk (no timing issues). Allows user to
-// read and write to the disk just as if it was dealing with sectors
+// Emulates a very simple disk (no timing issues, unless a timing model
+// is set). Allows user to read and write to the disk just as if it was
+// dealing with sectors
 //
 //
 
@@ -13,7 +14,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 
-// a few disk parameters
+// a few disk parameters (NUM_SECTORS is the size Disk_Init() gives you)
 #define SECTOR_SIZE  512
 #define NUM_SECTORS  10000
 #define MAX_INODE_BLOCKS 30
@@ -25,18 +26,112 @@ typedef enum {
   E_OPENING_FILE,
   E_WRITING_FILE,
   E_READING_FILE,
+  E_MAPPING_FILE,
 } Disk_Error_t;
 
+// hints for Disk_Map (or them together, 0 for none)
+#define DISK_MAP_HUGEPAGE  0x1   // back the mapping with transparent huge pages
+#define DISK_MAP_WILLNEED  0x2   // start faulting the whole image in right away
+#define DISK_MAP_RANDOM    0x4   // turn off kernel read-ahead on the image
+#define DISK_MAP_PRIVATE   0x8   // map copy-on-write, changes reach the file only when synced
+
 typedef struct sector {
   char data[SECTOR_SIZE];
 } Sector;
 
-extern Disk_Error_t diskErrno; // used to see what happened w/ disk ops
+// one run of contiguous sectors for Disk_ReadIOV/Disk_WriteIOV
+typedef struct disk_iovec {
+  int sector;    // first sector of the run
+  int count;     // sectors in the run
+  char* buffer;  // count * SECTOR_SIZE bytes
+} Disk_IOVec;
+
+// what a Disk_SyncDirty() (or a Disk_SyncStart() ticket) wrote out
+typedef struct disk_sync_stats {
+  int sectors;   // dirty sectors flushed
+  long bytes;    // bytes handed to write()/msync()
+  int writes;    // number of write()/msync() calls after merging runs
+} Disk_Sync_Stats;
+
+// what Disk_GetStats() counts (only builds with FS_STATS defined keep count)
+#define DISK_MAX_REGIONS 8
+#define DISK_MAX_SPANS   64
+
+typedef struct disk_stats {
+  long reads;                           // sectors read (copied out or pinned)
+  long writes;                          // sectors written (copied in or marked dirty)
+  long region_reads[DISK_MAX_REGIONS];  // the same by Disk_SetRegions() region
+  long region_writes[DISK_MAX_REGIONS];
+  long seeks;                           // accesses that didn't start where the last one ended
+  long seek_distance;                   // how far those jumped, in sectors, added up
+} Disk_Stats;
+
+// timing models for Disk_SetModel()
+#define DISK_MODEL_NONE  0   // every access is free (the default)
+#define DISK_MODEL_HDD   1   // one head: seek, wait for the sector to come round, transfer
+#define DISK_MODEL_SSD   2   // flash pages striped over channels that work in parallel
+
+#define DISK_MAX_CHANNELS 64
+
+typedef struct disk_model {
+  int type;              // DISK_MODEL_*
+  int sleep;             // also sleep for as long as each access would take
+  // DISK_MODEL_HDD
+  int rpm;
+  int sectors_per_track; // sets the transfer rate, and what counts as one cylinder
+  int seek_min_us;       // seek to the next cylinder...
+  int seek_max_us;       // ...and across the whole disk (the curve in between is a square root)
+  // DISK_MODEL_SSD
+  int channels;          // page p is on channel p % channels
+  int page_sectors;
+  int read_us;           // a page read or program, transfer included
+  int write_us;
+} Disk_Model;
+
+extern __thread Disk_Error_t diskErrno; // used to see what happened w/ disk ops
 
 int Disk_Init();
+int Disk_InitSize(int sectors);
+int Disk_NumSectors();
 int Disk_Save(char* file);
+int Disk_SyncDirty(char* file, Disk_Sync_Stats* stats);
+
+// background writeback: start a sync, then wait for or poll its ticket
+int Disk_SyncStart(char* file);
+int Disk_SyncWait(int ticket, Disk_Sync_Stats* stats);
+int Disk_SyncPoll(int ticket);
 int Disk_Load(char* file);
+int Disk_Map(char* file, int sectors, int flags);
 int Disk_Write(int sector, char* buffer);
 int Disk_Read(int sector, char* buffer);
 
+// multi-sector transfers: a contiguous run, or a list of runs
+int Disk_ReadV(int sector, int count, char* buffer);
+int Disk_WriteV(int sector, int count, char* buffer);
+int Disk_ReadIOV(Disk_IOVec* iov, int iovcnt);
+int Disk_WriteIOV(Disk_IOVec* iov, int iovcnt);
+
+// write-through: the sectors are on the image file when this returns
+int Disk_WriteThrough(int sector, int count, char* buffer);
+
+// zero-copy access: pin a sector, change it in place, unpin (and mark dirty)
+char* Disk_Get(int sector);
+int Disk_Put(int sector, int isDirty);
+int Disk_MarkDirty(int sector);
+char* Disk_GetV(int sector, int count);
+int Disk_PutV(int sector, int count, int isDirty);
+
+// statistics: span i runs from first[i] up to first[i + 1] and is counted
+// as region[i] (several spans can be the same region)
+int Disk_SetRegions(int* first, int* region, int count);
+int Disk_GetStats(Disk_Stats* stats);
+void Disk_ResetStats();
+
+// timing: set a model (NULL for none), then read how long the accesses
+// since the last reset would have taken, in nanoseconds of simulated time
+int Disk_DefaultModel(int type, Disk_Model* model);
+int Disk_SetModel(Disk_Model* model);
+long Disk_SimTime();
+void Disk_ResetSimTime();
+
 #endif // __Disk_H__
@@ -1,57 +1,539 @@
 #include "LibFS.h"
 #include "LibDisk.h"
+#include <pthread.h>
 #include <fcntl.h>   // For checking if the file exists
 #include <errno.h>   // For checking if the file exists
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 
-// global errno value here
-int osErrno;
+// global errno value here (one per thread)
+__thread int osErrno;
+
+// A run of contiguous data blocks
+typedef struct extent {
+    int start;              // first data block, -1 if the slot is unused
+    int length;             // number of blocks in the run
+} Extent;
+
+#define MAX_INODE_EXTENTS (MAX_INODE_BLOCKS / 2)
+
+// Block mapped inodes with INODE_INDIRECT
+#define NUM_DIRECT_BLOCKS (MAX_INODE_BLOCKS - 2)
+#define INDIRECT_SLOT     (MAX_INODE_BLOCKS - 2)
+#define DINDIRECT_SLOT    (MAX_INODE_BLOCKS - 1)
+
+// Inode flag bits kept above the Types value in Inode.type
+#define INODE_EXTENTS   0x100                       // data is mapped by extents[], not blocks[]
+#define INODE_INDIRECT  0x200                       // last two blocks[] are indirect and double indirect
+#define INODE_INLINE    0x400                       // a file small enough to be kept in data[], no blocks
+#define INODE_DIR_TAGS  0x800                       // a directory whose blocks have tags (see Dir_View)
+#define INODE_DIR_HASHED 0x1000                     // a tagged directory with a hash index (see Dir_Node)
+#define INODE_TYPE(t)   ((t) & 0xff)
 
 typedef struct inode {
     int size;
     int type;
-    int blocks[MAX_INODE_BLOCKS];
+    union {
+        int blocks[MAX_INODE_BLOCKS];               // directories: one data block per slot
+        Extent extents[MAX_INODE_EXTENTS];          // files (INODE_EXTENTS): runs of data blocks
+        char data[MAX_INODE_BLOCKS * sizeof(int)];  // files (INODE_INLINE): the contents
+    };
 } Inode;
 
+#define INLINE_BYTES ((int) sizeof(((Inode *) 0)->data))
+
 typedef struct log {
     char name[16];
     int inode_number;
 } Log;
 
-typedef struct dir_data_block {
-    Log logs[25];
-} Dir_Data_Block;
+// On-disk superblock (block 0).  Images made before it held the geometry
+// only have the magic number, and read back as version 0.
+//
+// From version 3 the inode table and data blocks are split into groups laid
+// out one after the other, each its slice of the inode table followed by
+// its slice of the data blocks, so a group's inodes sit right next to the
+// blocks allocated for them.  Older images read back as one group.
+typedef struct superblock {
+    char magic;                 // MAGIC_NUMBER
+    char pad[3];
+    int version;                // SUPERBLOCK_VERSION
+    int block_size;             // bytes, a power of two from SECTOR_SIZE to MAX_BLOCK_SIZE
+    int total_blocks;           // size of the disk in blocks
+    int num_inodes;
+    int inode_bitmap_start;     // the rest are block numbers and lengths in blocks
+    int inode_bitmap_blocks;
+    int data_bitmap_start;
+    int data_bitmap_blocks;
+    int inode_start;            // group 0's slice of the inode table
+    int inode_blocks;           // the length of each group's slice
+    int data_start;             // group 0's data blocks
+    int num_data_blocks;        // in all the groups
+    int journal_start;          // metadata journal (0 and 0 if the disk has none)
+    int journal_blocks;
+    int num_groups;             // version 3 on, filled in at boot for older images
+    int group_inodes;           // inodes per group (the last may have fewer)
+    int group_data_blocks;      // data blocks per group (likewise)
+    int group_blocks;           // from one group's start to the next
+} Superblock;
+
+#define SUPERBLOCK_VERSION  3
+#define MAX_BLOCK_SIZE      65536
+#define DEFAULT_BLOCK_SIZE  SECTOR_SIZE             // the defaults give the original 5 MB layout
+#define DEFAULT_NUM_BLOCKS  NUM_SECTORS
+#define DEFAULT_NUM_INODES  1000
+
+// Geometry dependent sizes, valid once a disk is booted
+#define BLOCK_SIZE          (sb.block_size)
+#define SECTORS_PER_BLOCK   (sb.block_size / SECTOR_SIZE)
+#define LOGS_PER_BLOCK      (sb.block_size / (int) sizeof(Log))
+#define INODES_PER_BLOCK    (sb.block_size / (int) sizeof(Inode))
+#define PTRS_PER_BLOCK      (sb.block_size / (int) sizeof(int))
+
+// Where data block n is on disk, and the first block of group g's inodes
+#define DATA_BLOCK(n)       (sb.data_start + (n) / sb.group_data_blocks * sb.group_blocks + (n) % sb.group_data_blocks)
+#define GROUP_INODES(g)     (sb.inode_start + (g) * sb.group_blocks)
+
+// A slice of an allocation bitmap with its own lock, so allocations in
+// different groups never wait on each other
+typedef struct alloc_group {
+    int first;              // first bit, a multiple of 64
+    int nbits;
+    int cursor;             // word the next search starts from (next fit)
+    int free_count;
+    pthread_mutex_t lock;
+} Alloc_Group;
+
+// In-memory copy of an allocation bitmap
+typedef struct bitmap_alloc {
+    uint64_t *words;        // bit set = allocated
+    int nbits;              // blocks covered
+    int nwords;
+    int start;              // first on-disk bitmap block
+    Alloc_Group *groups;
+    int ngroups;
+    int group_bits;         // bits per group (the last one may have fewer)
+} Bitmap_Alloc;
+
+// Bits to clear in one bitmap, gathered up so that every bitmap sector
+// they are in is pinned and written once, however they are spread
+typedef struct free_list {
+    Bitmap_Alloc *alloc;
+    int *bits;
+    int count;
+    int max;
+} Free_List;
+
+// Metadata journal.  Its first sector is a Journal_Header, the committed
+// transactions follow back to back, each one:
+//   descriptor sector(s): a Journal_Descriptor and the home sector numbers
+//   the new contents of those sectors, in the same order
+//   a Journal_Commit_Record
+// A transaction only counts if its sequence number follows on from the one
+// before it (the header's for the first) and its commit record checks out;
+// the first one that doesn't ends the log.
+typedef struct journal_header {
+    int magic;              // JOURNAL_MAGIC
+    int sequence;           // sequence number of the first transaction
+} Journal_Header;
+
+typedef struct journal_descriptor {
+    int magic;              // JOURNAL_DESC_MAGIC
+    int sequence;
+    int count;              // sectors in the transaction
+    int sectors[];          // their home sectors (running on into more descriptor sectors)
+} Journal_Descriptor;
+
+typedef struct journal_commit_record {
+    int magic;              // JOURNAL_COMMIT_MAGIC
+    int sequence;
+    unsigned int checksum;  // of the descriptor and contents
+} Journal_Commit_Record;
+
+#define JOURNAL_MAGIC           0x4a524e4c
+#define JOURNAL_DESC_MAGIC      0x4a445343
+#define JOURNAL_COMMIT_MAGIC    0x4a434d54
+#define JOURNAL_BYTES           (256 * 1024)    // journal size FS_Format asks for...
+#define JOURNAL_MIN_BLOCKS      (16 * JOURNAL_OP_BLOCKS)    // ...but at least this many blocks
+#define JOURNAL_OP_BLOCKS       20              // blocks one create or unlink can change (index splits and all)...
+#define JOURNAL_OP_SECTORS      16              // ...and inode, bitmap and pointer sectors besides
+#define JOURNAL_NAME_SECTORS    5               // what each name of a batch adds on top of that
+#define JOURNAL_BATCH_OPS       64              // group commit once this many operations pile up
+#define JOURNAL_DESC_SECTORS(n) ((int) ((sizeof(Journal_Descriptor) + (n) * sizeof(int) + SECTOR_SIZE - 1) / SECTOR_SIZE))
+#define JOURNAL_TX_SECTORS(n)   (JOURNAL_DESC_SECTORS(n) + (n) + 1)    // journal space of a transaction of n sectors
+#define ADD_BLOCK_SECTORS       (2 * SECTORS_PER_BLOCK + 4)   // most one Inode_Add_Block changes
+
+// What Journal_Commit does
+#define JOURNAL_APPEND      0   // append the running transaction to the journal
+#define JOURNAL_TRY_APPEND  1   // the same, unless a commit is already under way
+#define JOURNAL_SYNC_START  2   // append it, then start writing every dirty sector in place
+#define JOURNAL_CHECKPOINT  3   // append it, write everything in place, wait and empty the journal
+
+#define MAX_ALLOC_GROUPS        16
+#define MIN_INODE_GROUP_BITS    256     // inodes per allocation group, at least
+#define MIN_DATA_GROUP_BITS     4096    // data blocks per group, at least (extents never cross groups)
+
+// Cached directory entry: where a name's log lives in its directory
+typedef struct dentry {
+    char name[16];
+    int inode_number;
+    int block;              // data block holding the log
+    int slot;               // index of the log in that block
+    struct dentry *next;    // hash chain
+} Dentry;
+
+// A directory block.  The original format is just LOGS_PER_BLOCK logs.
+// Directories with INODE_DIR_TAGS put a tag byte per log in front of them
+// (padded to 16 bytes): 0 for a free log, otherwise 1 + the name's hash
+// mod 255.  Free logs, and the logs a name can be in, are then found by
+// comparing 16 or 32 tags at a time instead of going through the logs.
+typedef struct dir_view {
+    unsigned char *tags;    // NULL in the original format
+    Log *logs;
+    int slots;
+    int log_offset;         // where logs[0] is in the block
+} Dir_View;
+
+// The on-disk index of a directory with INODE_DIR_HASHED.  Its block 0 is
+// the root node.  A node's entries are sorted by hash and each covers the
+// hashes from its own up to the next one's, pointing at a node one level
+// down or, from the bottom level, at a leaf: a tagged directory block with
+// every name in that range.  Leaves that fill up split in two at a hash
+// (and nodes at an entry), so a lookup reads one block per level and one
+// leaf.  Nodes keep their tags zeroed and live where the logs would, so a
+// walk over every block of the directory sees them as empty blocks.
+#define DIR_MAX_LEVELS  3           // node levels under the root
+
+typedef struct dir_index {
+    unsigned int hash;      // lowest name hash this entry covers
+    int block;              // directory block (index in the inode) it points to
+} Dir_Index;
+
+typedef struct dir_node {
+    int count;              // entries in use
+    int levels;             // root only: node levels under it
+    int blocks;             // root only: directory blocks in use
+    int unused;
+    Dir_Index entries[];
+} Dir_Node;
+
+// A node on the way from the root to a leaf
+typedef struct dir_step {
+    int block;              // data block of the node
+    int pos;                // the entry followed
+} Dir_Step;
+
+// Hash index of one directory's logs
+typedef struct dir_cache {
+    Dentry **buckets;
+    int nbuckets;           // power of two
+    int count;
+    int type;               // the directory's inode type, for the block format
+} Dir_Cache;
+
+// One name of a File_CreateBatch/File_UnlinkBatch and where its log is
+typedef struct batch_entry {
+    char *name;
+    int inode_number;
+    int block;              // data block holding the log
+    int slot;               // index of the log in that block
+} Batch_Entry;
+
+// Path cache entry: a directory path ("a/b/c") and its inode
+typedef struct path_entry {
+    char *path;
+    int inode_number;
+    struct path_entry *next;
+} Path_Entry;
+
+#define PATH_CACHE_BUCKETS 1024
+#define MAX_PATH_CACHE_ENTRIES 8192
+#define MAX_PATH_LEN 1024
+
+// An open file's inode and buffer, shared by every fd open on it
+typedef struct file_cache {
+    int inode_number;
+    int refs;               // fds pointing here
+    Inode inode;            // cached copy of the inode
+    int inode_dirty;        // inode has to be written back
+    char *buffer;           // fd_buffer_blocks blocks of the file (read-ahead / write-behind)
+    int buf_start;          // file block at the start of the buffer, -1 if none
+    int buf_count;          // valid blocks from buf_start on
+    int dirty_lo;           // blocks in the buffer not yet written back
+    int dirty_hi;           // (dirty_lo > dirty_hi if none)
+} File_Cache;
+
+// Open file table entry
+typedef struct open_file {
+    File_Cache *file;       // NULL if the fd is free
+    int cursor;             // byte offset of the next read/write
+    int next_block;         // where a sequential access would start
+    int sequential;         // sequential accesses in a row
+} Open_File;
+
+// Open directory table entry: where a listing has got to
+typedef struct dir_cursor {
+    int inode_number;       // -1 if the handle is free
+    int index;              // block index in the directory
+    int slot;               // next log in that block
+} Dir_Cursor;
+
+#define MAX_OPEN_DIRS 64
+#define DIR_WALK_ENTRIES 64         // entries Dir_Unlink reads out of a directory at a time
+
+// Block mapping cache entry: data block of block index of an inode
+typedef struct bmap_entry {
+    int inode_number;       // -1 if unused
+    int index;
+    int block;
+} Bmap_Entry;
+
+#define BMAP_CACHE_SIZE 1024
+
+#define MAX_OPEN_FILES 256
+#define FD_BUFFER_BYTES (64 * 1024)
+
+// Statistics, only kept when built with FS_STATS.  COUNT_OP(op) goes with an
+// API call's declarations and times the call up to whichever return it
+// leaves by; COUNT adds to an FS_Stats counter.  Builds that keep them also
+// lose the per call trace output, which would swamp the timings.
+#ifdef FS_STATS
+typedef struct op_timer {
+    int op;
+    struct timespec start;
+} Op_Timer;
+
+#define COUNT_OP(op)        Op_Timer op_timer __attribute__((cleanup(End_Op))) = Start_Op(op)
+#define COUNT(field, n)     __atomic_fetch_add(&fs_stats.field, (n), __ATOMIC_RELAXED)
+#define DEBUG_PRINTF(...)   ((void) 0)
+#else
+#define COUNT_OP(op)        ((void) 0)
+#define COUNT(field, n)     ((void) (n))
+#define DEBUG_PRINTF(...)   printf(__VA_ARGS__)
+#endif
 
 /* CONSTANTS */
 static char MAGIC_NUMBER = 42;
-const int INODE_SEC_START = 5;
-const int DATA_SEC_START = 255;
 const int DATA_BITMAP_OFFSET = 2542;        // currently not used
-const int NUM_DATA_BLOCKS = 9745;
-const int NUM_INODE_BLOCKS = 250;
-const int INODE_BITMAP_SEC = 1;
-const int DATA_BITMAP_SEC = 2;
 const int FILE_DATA_SIZE = 20;              // The size in bytes of a single file information stored in a Dir's data block
 const int LOG_SIZE = 20;                    // size in bytes of a file log entry for a directory data block
 
 /* GLOBALS */
 char *filepath;
 const size_t MAX_FILE_SIZE = 16;
-char buf[SECTOR_SIZE];
+Superblock sb;                              // geometry of the booted disk
+Bitmap_Alloc inode_alloc;                   // built from the inode bitmap at boot
+Bitmap_Alloc data_alloc;                    // built from the data bitmap at boot
+int fd_buffer_blocks;                       // blocks in an open file's buffer
+Dir_Cache **dir_caches;                     // per directory inode, built lazily on first lookup
+int dir_cache_slots;
+Path_Entry *path_cache[PATH_CACHE_BUCKETS]; // parent directory paths resolved so far
+int path_cache_count;
+unsigned long path_epoch;                   // bumped by every Flush_Path_Cache
+Open_File open_files[MAX_OPEN_FILES];       // the open file table, indexed by fd
+Dir_Cursor open_dirs[MAX_OPEN_DIRS];        // the open directory table, indexed by Dir_Open handle
+Bmap_Entry bmap_cache[BMAP_CACHE_SIZE];     // indirect block mappings looked up so far
+int (*tag_find)(const unsigned char *, int, int, int, int);  // best tag scan the CPU has, set at boot
+int *journal_tx;                            // running transaction: home sectors changed, first change first
+int *journal_hash;                          // its sectors + 1, open addressed (0 is empty)
+int journal_hash_slots;
+int journal_count;                          // sectors in journal_tx (journal_max + 1 once it outgrew that)
+int journal_ops;                            // operations finished into it
+int journal_max;                            // most sectors a transaction can have, 0 if not journaling
+int journal_op;                             // what Journal_Begin sets aside for an ordinary operation...
+int journal_batch;                          // ...and for a piece of a batch
+int journal_reserved;                       // set aside by operations under way and not used yet
+__thread int journal_credit;                // what this thread's operation has left of its share
+__thread int journal_share;                 // what it was given
+int journal_seq;                            // sequence number of the next transaction committed
+int journal_pos;                            // sector in the journal it goes to
+#ifdef FS_STATS
+FS_Stats fs_stats;                          // what FS_GetStats hands out
+#endif
+
+/* LOCKS
+ *
+ * Every inode has a reader/writer lock.  A directory's is held for reading
+ * to look names up in it and for writing to add or remove them; a regular
+ * file's is held for writing by any read/write through its shared buffer.
+ * The rest of the shared state has a mutex of its own.  To stay deadlock
+ * free locks are only ever taken in this order:
+ *
+ *   0. commit_lock, journal_lock (every operation that changes metadata holds
+ *      journal_lock for reading from start to end, so a commit holding it
+ *      for writing never catches one half done; one that goes on in a new
+ *      journal piece lets go of every other lock first)
+ *   1. directory inode locks, parent before child (path walks hand over hand
+ *      from the root, holding at most a parent and its child)
+ *   2. file_lock
+ *   3. a regular file's inode lock
+ *   4. allocation group locks, lowest group first
+ *   5. bmap_lock, path_lock, journal_note_lock (nothing else is taken while
+ *      holding one)
+ *
+ * FS_Boot and FS_Format must not run alongside anything else.  An fd must
+ * only be used by one thread at a time, different fds (even on the same
+ * file) are fine.
+ */
+pthread_rwlock_t *inode_locks;              // one per inode
+int inode_lock_count;
+pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;                  // open_files[], File_Cache refs, open_dirs[]
+pthread_mutex_t bmap_lock = PTHREAD_MUTEX_INITIALIZER;                  // bmap_cache[]
+pthread_mutex_t path_lock = PTHREAD_MUTEX_INITIALIZER;                  // path_cache[]
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;                // one journal commit at a time
+pthread_rwlock_t journal_lock = PTHREAD_RWLOCK_INITIALIZER;             // see above
+pthread_mutex_t journal_note_lock = PTHREAD_MUTEX_INITIALIZER;          // journal_tx[], journal_reserved (taken last)
 
 /* FUNCTIONS */
-Dir_Data_Block New_Dir_Data_Block();
-int Find_Free_Inode_Block();
-int Find_Free_Data_Block();
-int Find_Pathname_Errors(char * file);
-int Create_Inode(int type);
-int Change_Bitmap_Value(int offset, int sec);
-int Get_Path_Token_Count(char *pathname);
+int Boot(char *path, Superblock *format);
+int Make_Geometry(Superblock *geometry, int block_size, int num_blocks, int num_inodes, int journal_blocks, int version);
+int Journal_Size(int block_size, int num_blocks);
+void Set_Disk_Regions();
+void Journal_Begin(int sectors);
+void Journal_End();
+void Journal_Piece();
+int Journal_Left();
+int Journal_Items(int each);
+int Journal_Bits(int start, int length, int keep);
+void Journal_Note(int sector, int count);
+int Journal_Commit(int mode, Disk_Sync_Stats *stats);
+int Journal_Build(char **out);
+int Journal_Reset();
+int Journal_Setup();
+int Journal_Replay();
+unsigned int Journal_Checksum(const char *data, int sectors);
+int Flush_Open_Files();
+char *Get_Block(int block);
+void Put_Block(int block, int dirty);
+void Dirty_Range(int block, int offset, int length);
+void Init_Dir_Block(char *data, int type);
+void View_Dir_Block(Dir_View *view, char *data, int type);
+int Dir_Find_Free(Dir_View *view, int from);
+int Dir_Find_Used(Dir_View *view, int from);
+int Dir_Find_Name(Dir_View *view, const char *name);
+void Fill_Dir_Slot(Dir_View *view, int block, int slot, const char *name, int inode_number, int mark);
+void Clear_Dir_Slot(Dir_View *view, int block, int slot);
+int Dir_Scan(int inode_number, const char *name, int *block, int *slot);
+int Dir_Lookup(int inode_number, const char *name, int *block, int *slot);
+Dir_Node *Dir_Node_At(char *data);
+int Dir_Node_Slots(char *data);
+int Dir_Index_Walk(int inode_number, Inode *inode, unsigned int hash, Dir_Step *path, int *depth);
+int Dir_Make_Index(int inode_number, Inode *inode);
+int Dir_Index_Add(int inode_number, Inode *inode, const char *name, int child);
+int Dir_Split_Leaf(int inode_number, Inode *inode, Dir_Step *path, int depth, int leaf, unsigned int hash);
+int Dir_Nodes_Needed(Dir_Step *path, int depth);
+int Dir_New_Blocks(int inode_number, Inode *inode, int count, int *out);
+void Dir_Node_Insert(int inode_number, Inode *inode, Dir_Step *path, int depth, unsigned int hash, int block, int *spare);
+void Dir_Node_Put(char *data, int node_block, int pos, unsigned int hash, int block);
+int Compare_Dir_Index(const void *a, const void *b);
+int Name_Tag(const char *name);
+int Tag_Find_Scalar(const unsigned char *tags, int from, int n, int tag, int equal);
+#if defined(__SSE2__)
+int Tag_Find_SSE2(const unsigned char *tags, int from, int n, int tag, int equal);
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+int Tag_Find_AVX2(const unsigned char *tags, int from, int n, int tag, int equal);
+#endif
+void Pick_Tag_Find();
+int Create_Inode(int type, int group);
+Inode *Pin_Inode(int inode_number);
+void Unpin_Inode(int inode_number, int dirty);
+int Inode_Sector(int inode_number);
+int Change_Bitmap_Value(Bitmap_Alloc *alloc, int offset, int value);
+void Free_List_Add(Free_List *list, int bit);
+void Free_List_Flush(Free_List *list);
+void Free_List_Finish(Free_List *blocks, Free_List *inodes);
+int Compare_Bit(const void *a, const void *b);
+int Change_Bitmap_Range(Bitmap_Alloc *alloc, int offset, int count, int value);
+int Load_Bitmap(Bitmap_Alloc *alloc, int start, int nbits, int min_group_bits, int group_bits);
+int Find_Free_Bit(Bitmap_Alloc *alloc, int g);
+int Alloc_Bit(Bitmap_Alloc *alloc, int g);
+void Lock_Groups(Bitmap_Alloc *alloc, int offset, int count);
+void Unlock_Groups(Bitmap_Alloc *alloc, int offset, int count);
+void Set_Bits(Bitmap_Alloc *alloc, int offset, int count, int value);
+int Inode_Group(int parent, int type);
+int Group_Free(Bitmap_Alloc *alloc, int g);
+int Data_Group(int inode_number);
+int Free_Run_Length(Bitmap_Alloc *alloc, int bit, int max);
+int Find_Free_Extent(Bitmap_Alloc *alloc, int g, int want, int *length);
+int Inode_Block_Count(Inode *inode);
+void Gather_Blocks(int inode_number, Free_List *list);
+void Gather_Pointers(int ptr_block, Free_List *list);
+int Inode_Run(Inode *inode, int index, int want, int *count);
+int Inode_Max_Blocks(Inode *inode);
+int Read_Pointer(int ptr_block, int index);
+int Inode_Map_Block(int inode_number, Inode *inode, int index);
+int New_Pointer_Block(int group);
+int Set_Pointer(int *slot, int index, int block, int group);
+int Inode_Add_Block(int inode_number, Inode *inode, int index, int block);
+void Drop_Bmap(int inode_number);
+int Inode_Reserve(int inode_number, Inode *inode, int nblocks);
+int Reserve_Blocks(int inode_number, Inode *inode, int index, int need);
+int Extents_To_Blocks(int inode_number, Inode *inode);
+void Free_Pointer_Blocks(Inode *inode);
+int Create_Entry(char *path, int type);
+int Unlink_Entry(char *file);
+int Create_Batch(char *path, char **names, int count, int *taken);
+int Unlink_Batch(char *path, char **names, int count);
+int Lock_Dir(char *path, int write);
+int Valid_Name(const char *name);
+int Compare_Batch_Name(const void *a, const void *b);
+int Compare_Batch_Slot(const void *a, const void *b);
+void Init_Inode(Inode *node, int type);
+int Alloc_Bits(Bitmap_Alloc *alloc, int g, int count, int *out);
+int Resolve_Parent(char *path, char *name);
+unsigned int Hash_Path(const char *path);
+int Path_Cache_Lookup(const char *path);
+void Path_Cache_Add(const char *path, int inode_number);
+void Flush_Path_Cache();
+File_Cache *Get_File_Cache(int inode_number);
+int Transfer_Blocks(Inode *inode, int index, int count, char *mem, int to_disk);
+int Window_Flush(File_Cache *fc);
+int Window_Move(File_Cache *fc, int start);
+int Window_Fill(File_Cache *fc, int upto);
+void Note_Access(Open_File *of, int first_block, int last_block);
+int Flush_File_Cache(File_Cache *fc);
+int Inline_Grow(File_Cache *fc, int nblocks);
+int Is_Open(int inode_number);
 int Is_In_Directory(int parent_inode_num, char *token);
 int Find_Inode(int inode_number, char *token);
 int Insert_Log(int parent_inode_num, char *token, int file_type);
-int Unlink_File_Log(int inode_to_search, char *token);
+void Unlink_File_Log(int inode_to_search, char *token, Free_List *blocks, Free_List *inodes);
+int Remove_Log(int parent_inode_num, char *token);
+int Unlink_Dir(char *path, int recursive);
+int Lock_Tree(int dir, int **dirs);
+unsigned int Hash_Name(const char *name);
+Dir_Cache *Get_Dir_Cache(int inode_number);
+Dentry *Dcache_Lookup(Dir_Cache *dir, const char *name);
+int Dcache_Add(Dir_Cache *dir, const char *name, int inode_number, int block, int slot);
+void Dcache_Remove(Dir_Cache *dir, const char *name);
+void Dcache_Note_Insert(int parent_inode_num, Log *log, int block, int slot);
+void Drop_Dir_Cache(int inode_number);
+
+void Lock_Inode(int inode_number, int write);
+void Unlock_Inode(int inode_number);
+int Inode_In_Use(int inode_number);
+int Is_Dir(int inode_number);
+int Lock_Parent(char *path, char *name, int write);
+Path_Entry *Path_Cache_Find(const char *path);
+void Free_Path_Cache();
+void Free_Dir_Cache(Dir_Cache *dir);
+int Read_Open_File(Open_File *of, char *out, int size);
+int Dir_Walk(int inode_number, int *index, int *slot, Dir_Entry *out, int max);
+int Write_Open_File(Open_File *of, char *in, int size);
+
+#ifdef FS_STATS
+Op_Timer Start_Op(int op);
+void End_Op(Op_Timer *timer);
+#endif
 
 void Debug_Testing();
 void Pointer_Printing(char *token);
@@ -62,54 +544,212 @@ void Array_Printing(char arr[]);
 int
 FS_Boot(char *path)     // Allocates memory in RAM for the disk file to be loaded
 {
+    COUNT_OP(FS_OP_BOOT);
+    return Boot(path, NULL);
+}
+
+/*
+ * FS_Format
+ *
+ * mkfs: (re)creates the disk image at path with the given geometry and boots
+ * it.  block_size is in bytes (a power of two from 512 to 64K), num_blocks is
+ * the size of the disk in blocks.  Anything in the file already is lost.
+ */
+int
+FS_Format(char *path, int block_size, int num_blocks, int num_inodes)
+{
+    Superblock geometry;
+    int f_desc;
+
+    DEBUG_PRINTF("FS_Format %s\n", path);
+    COUNT_OP(FS_OP_FORMAT);
+
+    if (Make_Geometry(&geometry, block_size, num_blocks, num_inodes, Journal_Size(block_size, num_blocks),
+                      SUPERBLOCK_VERSION) == -1) {
+        printf("FS_Format failed, bad geometry.\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    // An empty image file is what tells Boot to format
+    if ((f_desc = open(path, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR)) < 0) {
+        printf("There was a problem with opening the file.\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    close(f_desc);
+
+    return Boot(path, &geometry);
+}
+
+/*
+ * Boot
+ *
+ * Shared by FS_Boot and FS_Format.  An image file that doesn't exist yet (or
+ * is empty) is formatted with format, or the default geometry if that is
+ * NULL; otherwise the geometry is read back from its superblock.
+ */
+int
+Boot(char *path, Superblock *format)
+{
+    Superblock geometry;
+    struct stat st;
+    char buf[SECTOR_SIZE];
+    int i, f_desc, fresh, sectors = 0;
+
     filepath = path;
-    printf("FS_Boot %s\n", path);
+    DEBUG_PRINTF("FS_Boot %s\n", path);
+
+    // Determine if the file exists (it is created if not)
+    if ((f_desc = open(path, O_CREAT | O_RDONLY, S_IRUSR | S_IWUSR)) < 0 || fstat(f_desc, &st) < 0) {
+        printf("There was a problem with opening the file.\n");
+        osErrno = E_GENERAL;
+        if (f_desc >= 0) {
+            close(f_desc);
+        }
+        return -1;
+    }
+    close(f_desc);                      // close the file, it does not need to be open
+    fresh = (st.st_size == 0);
 
-    // oops, check for errors
-    if (Disk_Init() == -1) {            
-	printf("Disk_Init() failed\n");
-	osErrno = E_GENERAL;
-	return -1;
+    if (fresh) {
+        if (format != NULL) {
+            geometry = *format;
+        } else {
+            Make_Geometry(&geometry, DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS, DEFAULT_NUM_INODES,
+                          Journal_Size(DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS), SUPERBLOCK_VERSION);
+        }
+        sectors = geometry.total_blocks * (geometry.block_size / SECTOR_SIZE);
     }
 
-    // Determine if the file exists
-    int f_desc = open(path, O_CREAT | O_WRONLY | O_EXCL, S_IRUSR | S_IWUSR);  // will fail, returning -1 if the file EXISTS, otherwise the file is created
+    // Map the image file as the disk, so nothing has to be read in up front.
+    // The mapping is copy-on-write: changes must not reach the file before
+    // the journal has them, so like a loaded copy it only changes on commit
+    // and sync.  If it can't be mapped fall back to loading a copy of it.
+    if (Disk_Map(path, sectors, DISK_MAP_WILLNEED | DISK_MAP_PRIVATE) == -1) {
+        DEBUG_PRINTF("DEBUG: Disk_Map() failed, loading the image into memory\n");
 
-    if (f_desc < 0)
-    {
-        if (errno == EEXIST)        // if the file exists and open has failed
-        {
-            // load the disk file
-            if (Disk_Load(path) == -1) {
-            printf("Disk_Load() failed\n");
+        // oops, check for errors
+        if (Disk_InitSize(fresh ? sectors : (int) (st.st_size / SECTOR_SIZE)) == -1) {
+            printf("Disk_Init() failed\n");
             osErrno = E_GENERAL;
             return -1;
-            }
+        }
 
-            // Validate the magic number is correct (to check if the file is corrupt)
-            Disk_Read(0, buf);
-            if (buf[0] != MAGIC_NUMBER) {
-                printf("File does not match disk type or it is corrupt.\n");
-            } else {
-                printf("DEBUG: The file loaded successfully.\n");
-            }
+        // load the disk file
+        if (!fresh && Disk_Load(path) == -1) {
+            printf("Disk_Load() failed\n");
+            osErrno = E_GENERAL;
+            return -1;
+        }
+    }
 
-            // Make sure the file is the correct size
-            // TODO:  Should we use FSTAT for this?
+    Disk_Read(0, buf);                  // read in the superblock from disk
+    if (fresh) {
+        // the file has now been created and needs initial setup
+        geometry.magic = MAGIC_NUMBER;
+        memcpy(buf, &geometry, sizeof(Superblock));
+        Disk_Write(0, buf);             // Write the magic number and geometry to disk
+    } else {
+        // Validate the magic number is correct (to check if the file is corrupt)
+        memcpy(&geometry, buf, sizeof(Superblock));
+        if (buf[0] != MAGIC_NUMBER) {
+            printf("File does not match disk type or it is corrupt.\n");
+            osErrno = E_GENERAL;
+            return -1;
+        }
 
-        } else {
-            printf("There was a problem with opening the file.\n");
+        // Older images are all the default geometry, without a journal (so
+        // are version 1 ones, their journal fields read back as 0).  Anything
+        // else has to be exactly what Make_Geometry lays out, and fit in the
+        // file.  Before version 3 there was one group and no fields for it.
+        Superblock expect;
+        int valid;
+        if (geometry.version == 0) {
+            Make_Geometry(&geometry, DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS, DEFAULT_NUM_INODES, 0, 0);
+        }
+        valid = (Make_Geometry(&expect, geometry.block_size, geometry.total_blocks, geometry.num_inodes,
+                               geometry.journal_blocks, geometry.version) == 0);
+        if (valid && geometry.version < 3) {
+            memcpy(&geometry.num_groups, &expect.num_groups, sizeof(Superblock) - offsetof(Superblock, num_groups));
+        }
+        if (!valid ||
+            memcmp(&expect.block_size, &geometry.block_size, sizeof(Superblock) - offsetof(Superblock, block_size)) != 0 ||
+            (long) geometry.total_blocks * (geometry.block_size / SECTOR_SIZE) > Disk_NumSectors()) {
+            printf("File does not match disk type or it is corrupt.\n");
             osErrno = E_GENERAL;
             return -1;
         }
+        DEBUG_PRINTF("DEBUG: The file loaded successfully.\n");
+    }
+    sb = geometry;
+    Set_Disk_Regions();
+    Pick_Tag_Find();
+    fd_buffer_blocks = (FD_BUFFER_BYTES > sb.block_size) ? FD_BUFFER_BYTES / sb.block_size : 1;
+
+    // Forget the open files, directory indexes and paths of any previously booted disk
+    for (i = 0; i < MAX_OPEN_FILES; i++) {
+        File_Cache *fc = open_files[i].file;
+        open_files[i].file = NULL;
+        if (fc != NULL && --fc->refs == 0) {
+            free(fc->buffer);
+            free(fc);
+        }
+    }
+    for (i = 0; i < MAX_OPEN_DIRS; i++) {
+        open_dirs[i].inode_number = -1;
+    }
+    Flush_Path_Cache();
+    for (i = 0; i < BMAP_CACHE_SIZE; i++) {
+        bmap_cache[i].inode_number = -1;
+    }
+    for (i = 0; i < dir_cache_slots; i++) {
+        Drop_Dir_Cache(i);
+    }
+    free(dir_caches);
+    dir_cache_slots = sb.num_inodes;
+    if ((dir_caches = calloc(dir_cache_slots, sizeof(Dir_Cache *))) == NULL) {
+        dir_cache_slots = 0;
+        printf("Allocating the directory cache failed\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    // One lock per inode
+    for (i = 0; i < inode_lock_count; i++) {
+        pthread_rwlock_destroy(&inode_locks[i]);
+    }
+    free(inode_locks);
+    inode_lock_count = 0;
+    if ((inode_locks = malloc(sb.num_inodes * sizeof(pthread_rwlock_t))) == NULL) {
+        printf("Allocating the inode locks failed\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    for (inode_lock_count = 0; inode_lock_count < sb.num_inodes; inode_lock_count++) {
+        pthread_rwlock_init(&inode_locks[inode_lock_count], NULL);
+    }
+
+    // Finish whatever metadata changes were committed before a crash
+    if (Journal_Replay() == -1) {
+        printf("Replaying the journal failed\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    // Build the free space allocators from the on-disk bitmaps
+    // With more than one group on disk the allocation groups are those
+    if (Load_Bitmap(&inode_alloc, sb.inode_bitmap_start, sb.num_inodes, MIN_INODE_GROUP_BITS,
+                    (sb.num_groups > 1) ? sb.group_inodes : 0) == -1 ||
+        Load_Bitmap(&data_alloc, sb.data_bitmap_start, sb.num_data_blocks, MIN_DATA_GROUP_BITS,
+                    (sb.num_groups > 1) ? sb.group_data_blocks : 0) == -1) {
+        printf("Allocating the free space bitmaps failed\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
 
-        //TODO: Throw this into a Super_Init() function
-    } else {  // the file has now been created and needs initial setup (it is already open)
-        close(f_desc);                  // close the file, it does not need to be open
-        Disk_Read(0, buf);              // read in the superblock from disk
-        buf[0] = MAGIC_NUMBER;          // Assign the magic number to the first index of buffer
-        Disk_Write(0, buf);             // Write the magic number to disk
-        Create_Inode(DIR_FILE);         // Create the root directory inode
+    if (fresh) {
+        Create_Inode(DIR_FILE, 0);      // Create the root directory inode
     }
 
 //    Create_Inode(NORM_FILE);
@@ -118,549 +758,4839 @@ FS_Boot(char *path)     // Allocates memory in RAM for the disk file to be loade
     return 0;
 }
 
+/*
+ * Make_Geometry
+ *
+ * Lays out a disk: the superblock in block 0, then the inode bitmap, the
+ * data bitmap, the journal and the groups, each starting on a block
+ * boundary.  There are as many groups as there would be allocation groups
+ * of inodes and of data blocks (up to MAX_ALLOC_GROUPS), each a multiple
+ * of 64 of both.  The default geometry without a journal is small enough
+ * for one group and comes out as the original fixed layout (inode bitmap
+ * at 1, data bitmap at 2, inodes at 5, data at 255).
+ *
+ * Versions before 3 lay out one group and put the journal between the
+ * inode table and the data blocks, which is how those images were made.
+ * Returns -1 if the numbers don't make a usable disk.
+ */
+int
+Make_Geometry(Superblock *geometry, int block_size, int num_blocks, int num_inodes, int journal_blocks, int version)
+{
+    long bits_per_block = (long) block_size * 8;
+    long rest;
+    int groups, first, last;
+
+    memset(geometry, 0, sizeof(Superblock));
+
+    if (block_size < SECTOR_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0 ||
+        num_blocks <= 0 || num_inodes <= 0 || journal_blocks < 0 ||
+        (long) num_blocks * (block_size / SECTOR_SIZE) > 0x7fffffffL) {
+        return -1;
+    }
+
+    geometry->magic = MAGIC_NUMBER;
+    geometry->version = version;
+    geometry->block_size = block_size;
+    geometry->total_blocks = num_blocks;
+    geometry->num_inodes = num_inodes;
+
+    geometry->inode_bitmap_start = 1;
+    geometry->inode_bitmap_blocks = (int) ((num_inodes + bits_per_block - 1) / bits_per_block);
+    geometry->inode_blocks = (int) (((long) num_inodes * sizeof(Inode) + block_size - 1) / block_size);
+
+    // the data bitmap covers whatever is left, itself included (so it may run a bit long)
+    rest = (long) num_blocks - 1 - geometry->inode_bitmap_blocks - geometry->inode_blocks - journal_blocks;
+    if (rest <= 1) {
+        return -1;
+    }
+    geometry->data_bitmap_start = geometry->inode_bitmap_start + geometry->inode_bitmap_blocks;
+    geometry->data_bitmap_blocks = (int) ((rest + bits_per_block - 1) / bits_per_block);
+    first = geometry->data_bitmap_start + geometry->data_bitmap_blocks;
+
+    if (version < 3) {
+        geometry->inode_start = first;
+        if (journal_blocks > 0) {
+            geometry->journal_start = geometry->inode_start + geometry->inode_blocks;
+            geometry->journal_blocks = journal_blocks;
+        }
+        geometry->data_start = geometry->inode_start + geometry->inode_blocks + journal_blocks;
+        geometry->num_data_blocks = num_blocks - geometry->data_start;
+        geometry->num_groups = 1;
+        geometry->group_inodes = num_inodes;
+        geometry->group_data_blocks = geometry->num_data_blocks;
+        geometry->group_blocks = geometry->inode_blocks + geometry->num_data_blocks;
+        return (geometry->num_data_blocks > 0) ? 0 : -1;
+    }
+
+    if (journal_blocks > 0) {
+        geometry->journal_start = first;
+        geometry->journal_blocks = journal_blocks;
+        first += journal_blocks;
+    }
+
+    // Fewer groups if rounding leaves the last one without inodes or data
+    groups = num_inodes / MIN_INODE_GROUP_BITS;
+    if (groups > (num_blocks - first) / MIN_DATA_GROUP_BITS) {
+        groups = (num_blocks - first) / MIN_DATA_GROUP_BITS;
+    }
+    if (groups > MAX_ALLOC_GROUPS) {
+        groups = MAX_ALLOC_GROUPS;
+    }
+    for (; groups > 1; groups--) {
+        geometry->group_inodes = ((num_inodes + groups - 1) / groups + 63) / 64 * 64;
+        geometry->inode_blocks = (int) (((long) geometry->group_inodes * sizeof(Inode) + block_size - 1) / block_size);
+        rest = (long) num_blocks - first - (long) groups * geometry->inode_blocks;
+        geometry->group_data_blocks = (int) (((rest + groups - 1) / groups + 63) / 64 * 64);
+        last = (int) (rest - (long) (groups - 1) * geometry->group_data_blocks);
+        if ((num_inodes + geometry->group_inodes - 1) / geometry->group_inodes == groups && last > 0) {
+            break;
+        }
+    }
+    if (groups <= 1) {
+        groups = 1;
+        geometry->group_inodes = num_inodes;
+        geometry->inode_blocks = (int) (((long) num_inodes * sizeof(Inode) + block_size - 1) / block_size);
+        geometry->group_data_blocks = num_blocks - first - geometry->inode_blocks;
+    }
+
+    geometry->num_groups = groups;
+    geometry->group_blocks = geometry->inode_blocks + geometry->group_data_blocks;
+    geometry->inode_start = first;
+    geometry->data_start = first + geometry->inode_blocks;
+    geometry->num_data_blocks = num_blocks - first - groups * geometry->inode_blocks;
+    if (geometry->num_data_blocks <= 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Set_Disk_Regions
+ *
+ * Tells LibDisk which FS_Region each stretch of the booted disk is, in disk
+ * order, so Disk_GetStats can tell metadata from data.
+ */
+void
+Set_Disk_Regions()
+{
+    int first[3 + 2 * MAX_ALLOC_GROUPS], region[3 + 2 * MAX_ALLOC_GROUPS];
+    int i, j, g, n = 0;
+
+    first[n] = 0;
+    region[n++] = FS_REGION_SUPERBLOCK;
+    first[n] = sb.inode_bitmap_start;
+    region[n++] = FS_REGION_BITMAPS;
+    if (sb.journal_blocks > 0) {
+        first[n] = sb.journal_start;
+        region[n++] = FS_REGION_JOURNAL;
+    }
+    for (g = 0; g < sb.num_groups; g++) {
+        first[n] = GROUP_INODES(g);
+        region[n++] = FS_REGION_INODES;
+        first[n] = GROUP_INODES(g) + sb.inode_blocks;
+        region[n++] = FS_REGION_DATA;
+    }
+
+    // Into disk order (a version 2 disk has its journal after the inodes)
+    for (i = 1; i < n; i++) {
+        int f = first[i], r = region[i];
+        for (j = i; j > 0 && first[j - 1] > f; j--) {
+            first[j] = first[j - 1];
+            region[j] = region[j - 1];
+        }
+        first[j] = f;
+        region[j] = r;
+    }
+    for (i = 0; i < n; i++) {
+        first[i] *= SECTORS_PER_BLOCK;
+    }
+    Disk_SetRegions(first, region, n);
+}
+
+/*
+ * Journal_Size
+ *
+ * How many blocks of a disk FS_Format gives the journal: JOURNAL_BYTES, or
+ * JOURNAL_MIN_BLOCKS if that is more (a transaction has to hold a good few
+ * operations however big the blocks are), but never more than a sixteenth
+ * of the disk.
+ */
+int
+Journal_Size(int block_size, int num_blocks)
+{
+    int blocks = (block_size > 0) ? JOURNAL_BYTES / block_size : 0;
+
+    if (blocks < JOURNAL_MIN_BLOCKS) {
+        blocks = JOURNAL_MIN_BLOCKS;
+    }
+    if (blocks > num_blocks / 16) {
+        blocks = num_blocks / 16;
+    }
+    return blocks;
+}
+
+/*
+ * Get_Block
+ *
+ * Pins every sector of disk block block and returns a pointer to it, for
+ * looking at or changing in place.  Put_Block unpins it; changes have to be
+ * marked either there (the whole block) or with Dirty_Range first.
+ */
+char *
+Get_Block(int block)
+{
+    return Disk_GetV(block * SECTORS_PER_BLOCK, SECTORS_PER_BLOCK);
+}
+
+void
+Put_Block(int block, int dirty)
+{
+    if (dirty) {
+        Journal_Note(block * SECTORS_PER_BLOCK, SECTORS_PER_BLOCK);
+    }
+    Disk_PutV(block * SECTORS_PER_BLOCK, SECTORS_PER_BLOCK, dirty);
+}
+
+/*
+ * Dirty_Range
+ *
+ * Marks only the sectors under length bytes at offset in a pinned block as
+ * changed, so a small edit to a big block doesn't write the whole block back
+ * (or journal it).
+ */
+void
+Dirty_Range(int block, int offset, int length)
+{
+    int sec;
+
+    for (sec = offset / SECTOR_SIZE; sec <= (offset + length - 1) / SECTOR_SIZE; sec++) {
+        Disk_MarkDirty(block * SECTORS_PER_BLOCK + sec);
+        Journal_Note(block * SECTORS_PER_BLOCK + sec, 1);
+    }
+}
+
 int
 FS_Sync()       // Saves the current disk (from RAM) to a file (secondary storage)
 {
-    printf("FS_Sync\n");
-    // Save the file
-    if(Disk_Save(filepath) == -1) {
-    printf("Disk_Save() failed\n");
+    Disk_Sync_Stats stats;
+    int ret;
+
+    DEBUG_PRINTF("FS_Sync\n");
+    COUNT_OP(FS_OP_SYNC);
+
+    // Open files may still be holding written blocks and sizes
+    Journal_Begin(journal_op);
+    ret = Flush_Open_Files();
+    Journal_End();
+    if (ret == -1) {
+        return -1;                                  // osErrno is set by Flush_Open_Files
+    }
+
+    // Save the file (only the sectors that changed since the last sync),
+    // after which the journal starts over empty
+    if (Journal_Commit(JOURNAL_CHECKPOINT, &stats) == -1) {
+        return -1;                                  // osErrno is set by Journal_Commit
+    }
+
+    DEBUG_PRINTF("FS_Sync flushed %d sectors (%ld bytes) in %d writes\n",
+                 stats.sectors, stats.bytes, stats.writes);
+
+    return 0;
+}
+
+/*
+ * FS_SyncStart
+ *
+ * FS_Sync without the wait: everything written so far starts draining to
+ * the disk file in the background and a ticket comes back straight away.
+ * FS calls can carry on meanwhile; FS_SyncWait or FS_SyncPoll tell when it
+ * is safely on the file.  The metadata is safe (in the journal) as soon as
+ * this returns.
+ */
+int
+FS_SyncStart()
+{
+    int ret;
+
+    DEBUG_PRINTF("FS_SyncStart\n");
+    COUNT_OP(FS_OP_SYNC_START);
+
+    Journal_Begin(journal_op);
+    ret = Flush_Open_Files();
+    Journal_End();
+    if (ret == -1) {
+        return -1;
+    }
+    return Journal_Commit(JOURNAL_SYNC_START, NULL);
+}
+
+int
+FS_SyncWait(int ticket)
+{
+    DEBUG_PRINTF("FS_SyncWait %d\n", ticket);
+    COUNT_OP(FS_OP_SYNC_WAIT);
+
+    if (Disk_SyncWait(ticket, NULL) == -1) {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * FS_SyncPoll
+ *
+ * 1 once the sync with this ticket is on the disk file, 0 while it is
+ * still being written, -1 if it failed.
+ */
+int
+FS_SyncPoll(int ticket)
+{
+    int done;
+
+    if ((done = Disk_SyncPoll(ticket)) == -1) {
+        osErrno = E_GENERAL;
+    }
+    return done;
+}
+
+/*
+ * FS_Commit
+ *
+ * Makes every create, unlink and close finished so far survive a crash by
+ * appending them to the journal: one sequential write, however many
+ * operations piled up.  File contents (and files still open) only reach
+ * the disk file with FS_Sync.
+ */
+int
+FS_Commit()
+{
+    DEBUG_PRINTF("FS_Commit\n");
+    COUNT_OP(FS_OP_COMMIT);
+    return (Journal_Commit(JOURNAL_APPEND, NULL) == -1) ? -1 : 0;
+}
+
+/*
+ * FS_GetStats
+ *
+ * Copies out the call counts, call times and allocation counts gathered
+ * since boot (or the last FS_ResetStats).  Fails unless the library was
+ * built with FS_STATS.
+ */
+int
+FS_GetStats(FS_Stats *stats)
+{
+    if (stats == NULL) {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+#ifdef FS_STATS
+    long *from = (long *) &fs_stats, *to = (long *) stats;
+    int i;
+
+    for (i = 0; i < (int) (sizeof(FS_Stats) / sizeof(long)); i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+    return 0;
+#else
+    memset(stats, 0, sizeof(FS_Stats));
     osErrno = E_GENERAL;
+    return -1;
+#endif
+}
+
+void
+FS_ResetStats()
+{
+#ifdef FS_STATS
+    long *counts = (long *) &fs_stats;
+    int i;
+
+    for (i = 0; i < (int) (sizeof(FS_Stats) / sizeof(long)); i++) {
+        __atomic_store_n(&counts[i], 0, __ATOMIC_RELAXED);
+    }
+#endif
+}
+
+#ifdef FS_STATS
+/*
+ * Start_Op, End_Op
+ *
+ * What COUNT_OP expands to: the start time of a call, and adding the call
+ * and its time to fs_stats when the timer goes out of scope.
+ */
+Op_Timer
+Start_Op(int op)
+{
+    Op_Timer timer = { .op = op };
+
+    clock_gettime(CLOCK_MONOTONIC, &timer.start);
+    return timer;
+}
+
+void
+End_Op(Op_Timer *timer)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    COUNT(calls[timer->op], 1);
+    COUNT(nanoseconds[timer->op], (end.tv_sec - timer->start.tv_sec) * 1000000000L + (end.tv_nsec - timer->start.tv_nsec));
+}
+#endif
+
+/*
+ * Flush_Open_Files
+ *
+ * Writes back what open files are holding on to, inodes included, going
+ * on in a new journal piece whenever one is full.
+ */
+int
+Flush_Open_Files()
+{
+    int fd;
+
+    pthread_mutex_lock(&file_lock);
+    for (fd = 0; fd < MAX_OPEN_FILES; fd++) {
+        File_Cache *fc = open_files[fd].file;
+        int ret;
+
+        if (fc != NULL && Journal_Left() == 0) {
+            pthread_mutex_unlock(&file_lock);
+            Journal_Piece();
+            pthread_mutex_lock(&file_lock);
+            fc = open_files[fd].file;
+        }
+        if (fc == NULL) {
+            continue;
+        }
+        Lock_Inode(fc->inode_number, 1);
+        ret = Flush_File_Cache(fc);
+        Unlock_Inode(fc->inode_number);
+        if (ret == -1) {
+            pthread_mutex_unlock(&file_lock);
+            printf("Flushing fd %d failed\n", fd);
+            osErrno = E_GENERAL;
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&file_lock);
+    return 0;
+}
+
+/*
+ * Journal_Begin
+ *
+ * Brackets an operation that changes metadata, with Journal_End, so that a
+ * commit never copies it half done.  sectors is the most it can add to the
+ * running transaction (journal_op for an ordinary one): that much is set
+ * aside first, committing what is there to make room if need be, so the
+ * transaction never outgrows journal_max.  Takes journal_lock (see LOCKS),
+ * so it comes before any other lock.
+ */
+void
+Journal_Begin(int sectors)
+{
+    int failed = 0;
+
+    if (journal_max > 0) {
+        pthread_mutex_lock(&journal_note_lock);
+        while (!failed && journal_count + journal_reserved + sectors > journal_max &&
+               (journal_count > 0 || journal_reserved > 0)) {
+            pthread_mutex_unlock(&journal_note_lock);
+            failed = (Journal_Commit(JOURNAL_APPEND, NULL) == -1);
+            pthread_mutex_lock(&journal_note_lock);
+        }
+        journal_reserved += sectors;
+        pthread_mutex_unlock(&journal_note_lock);
+        journal_credit = journal_share = sectors;
+    }
+    pthread_rwlock_rdlock(&journal_lock);
+}
+
+/*
+ * Journal_End
+ *
+ * Ends an operation, and group commits the running transaction once enough
+ * of them have piled up.
+ */
+void
+Journal_End()
+{
+    int full;
+
+    pthread_rwlock_unlock(&journal_lock);
+    if (journal_max == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&journal_note_lock);
+    journal_reserved -= journal_credit;
+    journal_credit = 0;
+    full = (++journal_ops >= JOURNAL_BATCH_OPS || journal_count >= journal_max / 2);
+    pthread_mutex_unlock(&journal_note_lock);
+    if (full) {
+        Journal_Commit(JOURNAL_TRY_APPEND, NULL);
+    }
+}
+
+/*
+ * Journal_Piece
+ *
+ * For an operation too big for one transaction: ends what it has done so
+ * far (which has to leave the disk consistent, if with some space not yet
+ * given back) and goes on with a fresh share in a new piece.  The caller
+ * holds no locks but journal_lock.
+ */
+void
+Journal_Piece()
+{
+    pthread_rwlock_unlock(&journal_lock);
+    if (journal_max > 0) {
+        pthread_mutex_lock(&journal_note_lock);
+        journal_reserved -= journal_credit;
+        journal_credit = 0;
+        pthread_mutex_unlock(&journal_note_lock);
+    }
+    Journal_Begin(journal_share);
+}
+
+/*
+ * Journal_Left, Journal_Items
+ *
+ * How many more sectors this thread's operation can add to the running
+ * transaction (INT_MAX without a journal), and how many items costing each
+ * sectors apiece fit in it next to one ordinary operation's worth (at
+ * least one).
+ */
+int
+Journal_Left()
+{
+    return (journal_max > 0) ? journal_credit : INT_MAX;
+}
+
+int
+Journal_Items(int each)
+{
+    int left = Journal_Left();
+
+    if (left == INT_MAX) {
+        return INT_MAX;
+    }
+    return (left - journal_op >= each) ? (left - journal_op) / each : 1;
+}
+
+/*
+ * Journal_Bits
+ *
+ * How much of the run of length bitmap bits from start can still be
+ * changed in this piece with keep sectors left over for other things.
+ */
+int
+Journal_Bits(int start, int length, int keep)
+{
+    int left = Journal_Left(), bits = SECTOR_SIZE * 8, most;
+
+    if (left == INT_MAX) {
+        return length;
+    }
+    if (left <= keep) {
+        return 0;
+    }
+    most = (start / bits + left - keep) * bits - start;
+    return (length < most) ? length : most;
+}
+
+/*
+ * Journal_Note
+ *
+ * Adds count metadata sectors from sector on to the running transaction
+ * (each sector once, however often it changes).  Called once they have
+ * been changed, from inside Journal_Begin/Journal_End.  A transaction that
+ * somehow still outgrows journal_max is only counted from then on, and
+ * Journal_Commit turns it down.
+ */
+void
+Journal_Note(int sector, int count)
+{
+    unsigned int h;
+
+    if (journal_max == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&journal_note_lock);
+    for (; count > 0; sector++, count--) {
+        h = ((unsigned int) sector * 2654435761u) & (journal_hash_slots - 1);
+        while (journal_hash[h] != 0 && journal_hash[h] != sector + 1) {
+            h = (h + 1) & (journal_hash_slots - 1);
+        }
+        if (journal_hash[h] != 0) {
+            continue;                               // already in it
+        }
+        if (journal_count >= journal_max) {
+            journal_count = journal_max + 1;
+            break;
+        }
+        journal_hash[h] = sector + 1;
+        journal_tx[journal_count++] = sector;
+        if (journal_credit > 0) {
+            journal_credit--;
+            journal_reserved--;
+        }
+    }
+    pthread_mutex_unlock(&journal_note_lock);
+}
+
+/*
+ * Journal_Commit
+ *
+ * Commits the running transaction: its sectors, as they are now, go to the
+ * end of the journal in one write-through append.  What else happens
+ * depends on mode (see JOURNAL_APPEND etc.).  Nothing is written in place
+ * before it is in the journal: if the append leaves less room than the
+ * biggest transaction takes, it is a checkpoint straight away, which
+ * writes everything in place and empties the journal.  Returns the
+ * writeback ticket for JOURNAL_SYNC_START, or -1 with the transaction
+ * still pending.
+ */
+int
+Journal_Commit(int mode, Disk_Sync_Stats *stats)
+{
+    Journal_Descriptor *desc;
+    char *tx = NULL;
+    int i, outgrown, nsec = 0, ticket = 0, size = sb.journal_blocks * SECTORS_PER_BLOCK;
+
+    if (mode != JOURNAL_TRY_APPEND) {
+        pthread_mutex_lock(&commit_lock);
+    } else if (pthread_mutex_trylock(&commit_lock) != 0) {
+        return 0;                                   // that commit or the next one takes these along
+    }
+    pthread_rwlock_wrlock(&journal_lock);
+
+    // Copy the transaction out while no operation is half done
+    pthread_mutex_lock(&journal_note_lock);
+    if (journal_count > 0) {
+        if ((outgrown = (journal_count > journal_max)) || (nsec = Journal_Build(&tx)) == -1) {
+            pthread_mutex_unlock(&journal_note_lock);
+            pthread_rwlock_unlock(&journal_lock);
+            pthread_mutex_unlock(&commit_lock);
+            printf("Journal_Commit failed, %s.\n", outgrown ? "the transaction outgrew the journal" : "out of memory");
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        if (journal_pos + nsec + JOURNAL_TX_SECTORS(journal_max) > size) {
+            mode = JOURNAL_CHECKPOINT;
+        }
+        memset(journal_hash, 0, journal_hash_slots * sizeof(int));
+        journal_count = 0;
+        journal_ops = 0;
+    }
+    pthread_mutex_unlock(&journal_note_lock);
+
+    // New operations go on while a plain commit is written
+    if (mode == JOURNAL_APPEND || mode == JOURNAL_TRY_APPEND) {
+        pthread_rwlock_unlock(&journal_lock);
+    }
+    if (tx != NULL) {
+        if (Disk_WriteThrough(sb.journal_start * SECTORS_PER_BLOCK + journal_pos, nsec, tx) == -1) {
+            if (diskErrno != E_OPENING_FILE) {
+                // Its sectors go back in the running transaction for next time
+                desc = (Journal_Descriptor *) tx;
+                for (i = 0; i < desc->count; i++) {
+                    Journal_Note(desc->sectors[i], 1);
+                }
+                free(tx);
+                if (mode != JOURNAL_APPEND && mode != JOURNAL_TRY_APPEND) {
+                    pthread_rwlock_unlock(&journal_lock);
+                }
+                pthread_mutex_unlock(&commit_lock);
+                printf("Journal_Commit failed, writing the journal failed.\n");
+                osErrno = E_GENERAL;
+                return -1;
+            }
+
+            // No image file yet: there is nothing on disk to keep safe, its
+            // sectors are still dirty and all go in place with the first sync
+            DEBUG_PRINTF("DEBUG: Journal commit failed, checkpointing instead\n");
+            if (mode == JOURNAL_APPEND || mode == JOURNAL_TRY_APPEND) {
+                pthread_rwlock_wrlock(&journal_lock);
+            }
+            mode = JOURNAL_CHECKPOINT;
+        } else {
+            journal_pos += nsec;
+            journal_seq++;
+        }
+        free(tx);
+    }
+    if (mode == JOURNAL_APPEND || mode == JOURNAL_TRY_APPEND) {
+        pthread_mutex_unlock(&commit_lock);
+        return 0;
+    }
+
+    // Everything dirty goes in place, taken as it is now, after the journal
+    ticket = Disk_SyncStart(filepath);
+    pthread_rwlock_unlock(&journal_lock);
+    if (ticket == -1) {
+        pthread_mutex_unlock(&commit_lock);
+        printf("Disk_SyncStart() failed\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    if (mode == JOURNAL_CHECKPOINT) {
+        if (Disk_SyncWait(ticket, stats) == -1) {
+            pthread_mutex_unlock(&commit_lock);
+            printf("Disk_SyncWait() failed\n");
+            osErrno = E_GENERAL;
+            return -1;
+        }
+
+        // Nothing in the journal is newer than the disk now
+        if (sb.journal_blocks > 0 && Journal_Reset() == -1) {
+            pthread_mutex_unlock(&commit_lock);
+            printf("Resetting the journal failed\n");
+            osErrno = E_GENERAL;
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&commit_lock);
+    return ticket;
+}
+
+/*
+ * Journal_Build
+ *
+ * Lays the running transaction out the way it goes in the journal:
+ * descriptor, sector contents, commit record.  Returns its length in
+ * sectors with the buffer (to be freed) in out, or -1.  The caller holds
+ * journal_lock for writing.
+ */
+int
+Journal_Build(char **out)
+{
+    Journal_Descriptor *desc;
+    Journal_Commit_Record *commit;
+    int ndesc = JOURNAL_DESC_SECTORS(journal_count);
+    int nsec = ndesc + journal_count + 1;
+    char *tx;
+    int i;
+
+    if ((tx = calloc(nsec, SECTOR_SIZE)) == NULL) {
+        return -1;
+    }
+    desc = (Journal_Descriptor *) tx;
+    desc->magic = JOURNAL_DESC_MAGIC;
+    desc->sequence = journal_seq;
+    desc->count = journal_count;
+    for (i = 0; i < journal_count; i++) {
+        desc->sectors[i] = journal_tx[i];
+        Disk_Read(journal_tx[i], tx + (ndesc + i) * SECTOR_SIZE);
+    }
+
+    commit = (Journal_Commit_Record *) (tx + (nsec - 1) * SECTOR_SIZE);
+    commit->magic = JOURNAL_COMMIT_MAGIC;
+    commit->sequence = journal_seq;
+    commit->checksum = Journal_Checksum(tx, nsec - 1);
+
+    *out = tx;
+    return nsec;
+}
+
+/*
+ * Journal_Reset
+ *
+ * Empties the journal: a new header starting at the next sequence number,
+ * so whatever transactions are still in it never match again.
+ */
+int
+Journal_Reset()
+{
+    char buf[SECTOR_SIZE];
+    Journal_Header *header = (Journal_Header *) buf;
+
+    memset(buf, 0, SECTOR_SIZE);
+    header->magic = JOURNAL_MAGIC;
+    header->sequence = journal_seq;
+    journal_pos = 1;
+
+    if (Disk_WriteThrough(sb.journal_start * SECTORS_PER_BLOCK, 1, buf) == -1) {
+        // a freshly formatted disk with no image yet gets it with the first sync
+        return Disk_Write(sb.journal_start * SECTORS_PER_BLOCK, buf);
+    }
+    return 0;
+}
+
+/*
+ * Journal_Setup
+ *
+ * Sizes the running transaction for the booted disk's journal.  The
+ * biggest one may take up to half of it, so that after any commit that
+ * leaves room for another of those (see Journal_Commit) there is still
+ * some to spare.  A journal too small for even one operation isn't used:
+ * the disk then runs as one without a journal.
+ */
+int
+Journal_Setup()
+{
+    int size = sb.journal_blocks * SECTORS_PER_BLOCK;
+
+    free(journal_tx);
+    free(journal_hash);
+    journal_tx = NULL;
+    journal_hash = NULL;
+    journal_count = 0;
+    journal_ops = 0;
+    journal_reserved = 0;
+
+    for (journal_max = (size - 1) / 2; journal_max > 0 && JOURNAL_TX_SECTORS(journal_max) > (size - 1) / 2; journal_max--)
+        ;
+    journal_op = JOURNAL_OP_BLOCKS * SECTORS_PER_BLOCK + JOURNAL_OP_SECTORS;
+    journal_batch = (journal_max / 2 > journal_op) ? journal_max / 2 : journal_op;
+    if (journal_max < journal_op) {
+        journal_max = 0;
+        return 0;
+    }
+
+    for (journal_hash_slots = 1; journal_hash_slots < 2 * journal_max; journal_hash_slots *= 2)
+        ;
+    journal_tx = malloc(journal_max * sizeof(int));
+    journal_hash = calloc(journal_hash_slots, sizeof(int));
+    if (journal_tx == NULL || journal_hash == NULL) {
+        journal_max = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Journal_Replay
+ *
+ * Boot time recovery: writes the sectors of every committed transaction in
+ * the journal back to where they belong, oldest first, saves them in place
+ * and empties the journal.  A transaction cut short by a crash has no
+ * valid commit record and is left out.
+ */
+int
+Journal_Replay()
+{
+    char buf[SECTOR_SIZE];
+    Journal_Header *header = (Journal_Header *) buf;
+    Journal_Descriptor *desc;
+    Journal_Commit_Record *commit;
+    int first = sb.journal_start * SECTORS_PER_BLOCK;
+    int size = sb.journal_blocks * SECTORS_PER_BLOCK;
+    int i, ndesc, nsec, bad, valid, applied = 0;
+    char *tx;
+
+    journal_seq = 1;
+    journal_pos = 1;
+    if (Journal_Setup() == -1) {
+        return -1;
+    }
+    if (sb.journal_blocks == 0) {
+        return 0;
+    }
+
+    Disk_Read(first, buf);
+    if ((valid = (header->magic == JOURNAL_MAGIC))) {
+        journal_seq = header->sequence;
+    }
+
+    while (valid && journal_pos < size) {
+        Disk_Read(first + journal_pos, buf);
+        desc = (Journal_Descriptor *) buf;
+        if (desc->magic != JOURNAL_DESC_MAGIC || desc->sequence != journal_seq ||
+            desc->count <= 0 || desc->count > size) {
+            break;
+        }
+        ndesc = JOURNAL_DESC_SECTORS(desc->count);
+        nsec = ndesc + desc->count + 1;
+        if (journal_pos + nsec > size || (tx = malloc((size_t) nsec * SECTOR_SIZE)) == NULL) {
+            break;
+        }
+        Disk_ReadV(first + journal_pos, nsec, tx);
+        desc = (Journal_Descriptor *) tx;
+        commit = (Journal_Commit_Record *) (tx + (nsec - 1) * SECTOR_SIZE);
+        bad = (commit->magic != JOURNAL_COMMIT_MAGIC || commit->sequence != journal_seq ||
+               commit->checksum != Journal_Checksum(tx, nsec - 1));
+        for (i = 0; !bad && i < desc->count; i++) {
+            bad = (desc->sectors[i] < 0 || desc->sectors[i] >= Disk_NumSectors() ||
+                   (desc->sectors[i] >= first && desc->sectors[i] < first + size));
+        }
+        for (i = 0; !bad && i < desc->count; i++) {
+            Disk_Write(desc->sectors[i], tx + (ndesc + i) * SECTOR_SIZE);
+        }
+        free(tx);
+        if (bad) {
+            break;
+        }
+        journal_pos += nsec;
+        journal_seq++;
+        applied++;
+    }
+
+    if (applied > 0) {
+        DEBUG_PRINTF("DEBUG: Replayed %d journal transactions\n", applied);
+        if (Disk_SyncDirty(filepath, NULL) == -1) {
+            return -1;
+        }
+    }
+    return Journal_Reset();
+}
+
+/*
+ * Journal_Checksum
+ *
+ * FNV-1a over a run of sectors.
+ */
+unsigned int
+Journal_Checksum(const char *data, int sectors)
+{
+    unsigned int hash = 2166136261u;
+    long i;
+
+    for (i = 0; i < (long) sectors * SECTOR_SIZE; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int
+File_Create(char *file)
+{
+    int ret;
+
+    DEBUG_PRINTF("FS_Create\n");
+    COUNT_OP(FS_OP_CREATE);
+    Journal_Begin(journal_op);
+    ret = Create_Entry(file, NORM_FILE);
+    Journal_End();
+    return ret;
+}
+
+/*
+ * Create_Entry
+ *
+ * Shared by File_Create and Dir_Create: resolves the parent directory of
+ * path (through the path cache) and adds a new log of the given type to it.
+ */
+int
+Create_Entry(char *path, int type)
+{
+    char name[MAX_FILE_SIZE + 1];
+    int parent;
+
+    if ((parent = Lock_Parent(path, name, 1)) == -1) {
+        osErrno = E_CREATE;
+        printf("Create failed.  Bad path or no such directory: %s\n", path);
+        return -1;
+    }
+
+    if ((Is_In_Directory(parent, name)) == 0) {
+        Unlock_Inode(parent);
+        osErrno = E_CREATE;
+        printf("File_Create failed.  Filename %s already exists.\n", name);
+        return -1;
+    }
+
+    if (Insert_Log(parent, name, type) == -1) {     // osErrno is set inside this function and -1 is returned
+        Unlock_Inode(parent);
+        return -1;
+    }
+    Unlock_Inode(parent);
+    return 0;
+}
+
+/*
+ * Lock_Parent
+ *
+ * Resolve_Parent, then locks the parent directory (for writing if write is
+ * set) and makes sure it wasn't unlinked in the meantime.  Returns the
+ * parent's inode number still locked, or -1 with nothing locked.
+ */
+int
+Lock_Parent(char *path, char *name, int write)
+{
+    unsigned long epoch;
+    int parent;
+
+    // A directory unlinked between the lookup and the lock may already be
+    // a new one under the same inode number, so then look it up again (the
+    // unlink holds the lock on it until it has flushed the path cache)
+    for (;;) {
+        epoch = __atomic_load_n(&path_epoch, __ATOMIC_ACQUIRE);
+        if ((parent = Resolve_Parent(path, name)) == -1) {
+            return -1;
+        }
+        Lock_Inode(parent, write);
+        if (epoch == __atomic_load_n(&path_epoch, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        Unlock_Inode(parent);
+    }
+    if (!Inode_In_Use(parent) || Get_Dir_Cache(parent) == NULL) {
+        Unlock_Inode(parent);
+        return -1;
+    }
+    return parent;
+}
+
+/*
+ * Lock_Dir
+ *
+ * Like Lock_Parent, but for the directory path names itself ("/" or "" is
+ * the root).  Returns its inode number locked, or -1 with nothing locked.
+ */
+int
+Lock_Dir(char *path, int write)
+{
+    char name[MAX_FILE_SIZE + 1];
+    int parent, dir;
+
+    if (path[strspn(path, "/")] == '\0') {
+        dir = 0;
+        Lock_Inode(dir, write);
+    } else {
+        if ((parent = Lock_Parent(path, name, 0)) == -1) {
+            return -1;
+        }
+        if ((dir = Find_Inode(parent, name)) == -1 || !Is_Dir(dir)) {
+            Unlock_Inode(parent);
+            return -1;
+        }
+        Lock_Inode(dir, write);
+        Unlock_Inode(parent);
+    }
+    if (Get_Dir_Cache(dir) == NULL) {
+        Unlock_Inode(dir);
+        return -1;
+    }
+    return dir;
+}
+
+/*
+ * Valid_Name
+ *
+ * Whether name can be a single directory entry: not empty, no slashes,
+ * and short enough for a Log.
+ */
+int
+Valid_Name(const char *name)
+{
+    size_t len = strnlen(name, MAX_FILE_SIZE + 1);
+
+    return len > 0 && len <= MAX_FILE_SIZE && memchr(name, '/', len) == NULL;
+}
+
+/*
+ * File_CreateBatch
+ *
+ * Creates count regular files in the directory dir, one per name.  The
+ * directory is looked up and locked once, the inodes are allocated a run
+ * at a time and the directory's blocks are walked once for all the new
+ * logs, so each sector that changes is only touched once.  Names that are
+ * bad or already there are skipped (osErrno E_CREATE), as are whatever
+ * names don't fit once the disk or the directory is full (E_NO_SPACE).
+ * A big batch goes in as many journal pieces as it takes, each one a
+ * transaction of its own.  Returns how many files were created, or -1 if
+ * dir is no directory.
+ */
+int
+File_CreateBatch(char *dir, char **names, int count)
+{
+    int ret, first = 0, taken, done = 0;
+
+    DEBUG_PRINTF("FS_CreateBatch %s\n", dir);
+    COUNT_OP(FS_OP_CREATE_BATCH);
+    do {
+        Journal_Begin(journal_batch);
+        ret = Create_Batch(dir, names + first, count - first, &taken);
+        Journal_End();
+        if (ret == -1) {
+            return (first == 0) ? -1 : done;
+        }
+        done += ret;
+        first += taken;
+    } while (first < count);
+    return done;
+}
+
+/*
+ * Create_Batch
+ *
+ * One piece of File_CreateBatch: as many of the names from the front as
+ * the journal piece has room for.  How many of them it dealt with
+ * (created, skipped or given up on) goes in *taken.
+ */
+int
+Create_Batch(char *path, char **names, int count, int *taken)
+{
+    Batch_Entry *entries;
+    Inode *parent_inode;
+    Dir_View view;
+    char *data;
+    int *inodes;
+    int parent, i, j, n = 0, got, done = 0, block, max_blocks, most, full = 0;
+
+    *taken = count;
+
+    if ((parent = Lock_Dir(path, 1)) == -1) {
+        osErrno = E_CREATE;
+        printf("Create failed.  Bad path or no such directory: %s\n", path);
+        return -1;
+    }
+    if (count <= 0) {
+        Unlock_Inode(parent);
+        return 0;
+    }
+    most = Journal_Items(JOURNAL_NAME_SECTORS);
+    if (most > count) {
+        most = count;
+    }
+    entries = malloc(most * sizeof(Batch_Entry));
+    inodes = malloc(most * sizeof(int));
+    if (entries == NULL || inodes == NULL) {
+        Unlock_Inode(parent);
+        free(entries);
+        free(inodes);
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    // Weed out bad names, names already there and repeats
+    for (i = 0; i < count && n < most; i++) {
+        if (!Valid_Name(names[i]) || Find_Inode(parent, names[i]) != -1) {
+            osErrno = E_CREATE;
+            printf("File_CreateBatch skipped %.*s.\n", (int) MAX_FILE_SIZE, names[i]);
+            continue;
+        }
+        entries[n].name = names[i];
+        entries[n].block = 0;
+        entries[n].slot = i;                        // so Compare_Batch_Slot gives back the caller's order
+        n++;
+    }
+    *taken = i;
+    qsort(entries, n, sizeof(Batch_Entry), Compare_Batch_Name);
+    for (i = 0, j = 0; i < n; i++) {
+        if (j > 0 && Compare_Batch_Name(&entries[j - 1], &entries[i]) == 0) {
+            osErrno = E_CREATE;
+            continue;
+        }
+        entries[j++] = entries[i];
+    }
+    n = j;
+    qsort(entries, n, sizeof(Batch_Entry), Compare_Batch_Slot);
+
+    // All the inodes at once
+    if ((got = Alloc_Bits(&inode_alloc, Inode_Group(parent, NORM_FILE), n, inodes)) < n) {
+        osErrno = E_NO_SPACE;
+        printf("File_CreateBatch: disk space full after %d files.\n", got);
+    }
+    for (i = 0; i < got; i++) {
+        Init_Inode(Pin_Inode(inodes[i]), NORM_FILE);
+        Unpin_Inode(inodes[i], 1);
+    }
+
+    // One pass over the directory fills free logs (and new blocks) in turn
+    parent_inode = Pin_Inode(parent);
+    max_blocks = Inode_Max_Blocks(parent_inode);
+    for (j = 0; done < got && j < max_blocks && !(parent_inode->type & INODE_DIR_HASHED); j++) {
+        int fresh = 0;
+
+        if ((block = Inode_Map_Block(parent, parent_inode, j)) == -1) {
+            if (done > 0 && Journal_Left() < journal_op) {
+                full = 1;                           // the rest go in the next piece
+                break;
+            }
+            if (j == 1 && (parent_inode->type & INODE_DIR_TAGS)) {
+                if (Dir_Make_Index(parent, parent_inode) == -1) {
+                    break;
+                }
+                continue;                           // the rest go through the index
+            }
+            if ((block = Alloc_Bit(&data_alloc, Data_Group(parent))) == -1) {
+                break;
+            }
+            if (Inode_Add_Block(parent, parent_inode, j, block) == -1) {
+                Change_Bitmap_Value(&data_alloc, block, 0);
+                break;
+            }
+            fresh = 1;
+        }
+
+        data = Get_Block(DATA_BLOCK(block));
+        if (fresh) {
+            Init_Dir_Block(data, parent_inode->type);
+        }
+        View_Dir_Block(&view, data, parent_inode->type);
+        for (i = Dir_Find_Free(&view, 0); i != -1 && done < got; i = Dir_Find_Free(&view, i + 1)) {
+            if (done > 0 && Journal_Left() < JOURNAL_NAME_SECTORS) {
+                full = 1;
+                break;
+            }
+            Fill_Dir_Slot(&view, block, i, entries[done].name, inodes[done], !fresh);
+            Dcache_Note_Insert(parent, &view.logs[i], block, i);
+            done++;
+        }
+        Put_Block(DATA_BLOCK(block), fresh);
+        if (full) {
+            break;
+        }
+    }
+    while (done < got && (parent_inode->type & INODE_DIR_HASHED) && !full) {
+        if (done > 0 && Journal_Left() < journal_op) {
+            full = 1;
+        } else if (Dir_Index_Add(parent, parent_inode, entries[done].name, inodes[done]) == 0) {
+            done++;
+        } else {
+            break;
+        }
+    }
+    parent_inode->size += done * sizeof(Log);
+    Unpin_Inode(parent, 1);
+
+    // Give back the inodes that didn't get a log
+    if (full) {
+        *taken = entries[done].slot;
+    } else if (done < got) {
+        osErrno = E_NO_SPACE;
+        printf("File_CreateBatch failed, not enough space in directory.\n");
+    }
+    for (i = done; i < got; i++) {
+        Change_Bitmap_Value(&inode_alloc, inodes[i], 0);
+    }
+    Unlock_Inode(parent);
+
+    DEBUG_PRINTF("DEBUG: Created %d of %d files in %s\n", done, count, path);
+    free(entries);
+    free(inodes);
+    return done;
+}
+
+/*
+ * Compare_Batch_Name, Compare_Batch_Slot
+ *
+ * qsort orders for batch entries: by name and by where their logs are.
+ */
+int
+Compare_Batch_Name(const void *a, const void *b)
+{
+    return strncmp(((const Batch_Entry *) a)->name, ((const Batch_Entry *) b)->name, MAX_FILE_SIZE);
+}
+
+int
+Compare_Batch_Slot(const void *a, const void *b)
+{
+    const Batch_Entry *x = a, *y = b;
+
+    if (x->block != y->block) {
+        return (x->block < y->block) ? -1 : 1;
+    }
+    return (x->slot > y->slot) - (x->slot < y->slot);
+}
+
+/*
+ * Resolve_Parent
+ *
+ * Splits path into its parent directory and its last name (copied into
+ * name, which must hold MAX_FILE_SIZE + 1 chars), checking the length of
+ * every name on the way, and returns the parent's inode number.  Parent
+ * paths are looked up in the path cache first; on a miss they are walked
+ * down from the root inode and every prefix seen is cached.  Returns -1 for
+ * a bad path or a missing directory.  Nothing is left locked; the walk
+ * itself holds a directory's lock only until its child's is taken.
+ */
+int
+Resolve_Parent(char *path, char *name)
+{
+    char parent[MAX_PATH_LEN];
+    char token[MAX_FILE_SIZE + 1];
+    int end, start, len = 0, i, inode_number, child;
+    size_t token_len;
+
+    // Find the last name, ignoring trailing slashes
+    end = strlen(path);
+    while (end > 0 && path[end - 1] == '/') {
+        end--;
+    }
+    start = end;
+    while (start > 0 && path[start - 1] != '/') {
+        start--;
+    }
+    if (end == start) {
+        printf("Create failed.  File/Dir name cannot be null.\n");
+        return -1;
+    }
+    if (end - start > (int) MAX_FILE_SIZE) {
+        printf("Create failed. File/Dir name %.*s is too long.\n", end - start, path + start);
+        return -1;
+    }
+    memcpy(name, path + start, end - start);
+    name[end - start] = '\0';
+
+    // The parent as "a/b/c": no leading, trailing or doubled slashes
+    for (i = 0; i < start; i++) {
+        if (path[i] == '/' && (len == 0 || parent[len - 1] == '/')) {
+            continue;
+        }
+        if (len == MAX_PATH_LEN - 1) {
+            return -1;
+        }
+        parent[len++] = path[i];
+    }
+    if (len > 0 && parent[len - 1] == '/') {
+        len--;
+    }
+    parent[len] = '\0';
+
+    if (len == 0) {
+        return 0;                                   // the root directory
+    }
+    if ((inode_number = Path_Cache_Lookup(parent)) != -1) {
+        return inode_number;
+    }
+
+    // Not cached: walk down from the root, caching each directory on the way
+    inode_number = 0;
+    Lock_Inode(inode_number, 0);
+    for (i = 0; i <= len; i = start + token_len + 1) {
+        start = i;
+        token_len = strcspn(parent + start, "/");
+        if (token_len > MAX_FILE_SIZE) {
+            Unlock_Inode(inode_number);
+            printf("Create failed. File/Dir name %.*s is too long.\n", (int) token_len, parent + start);
+            return -1;
+        }
+        memcpy(token, parent + start, token_len);
+        token[token_len] = '\0';
+
+        // Only directories are locked (and walked) on the way down
+        if ((child = Find_Inode(inode_number, token)) == -1 || !Is_Dir(child)) {
+            Unlock_Inode(inode_number);
+            return -1;
+        }
+        Lock_Inode(child, 0);
+        Unlock_Inode(inode_number);
+        inode_number = child;
+        if (Get_Dir_Cache(inode_number) == NULL) {
+            Unlock_Inode(inode_number);
+            return -1;
+        }
+
+        parent[start + token_len] = '\0';
+        Path_Cache_Add(parent, inode_number);
+        if (start + token_len < (size_t) len) {
+            parent[start + token_len] = '/';
+        }
+    }
+    Unlock_Inode(inode_number);
+
+    return inode_number;
+}
+
+unsigned int
+Hash_Path(const char *path)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*path != '\0') {
+        hash ^= (unsigned char) *path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int
+Path_Cache_Lookup(const char *path)
+{
+    Path_Entry *entry;
+    int inode_number;
+
+    pthread_mutex_lock(&path_lock);
+    entry = Path_Cache_Find(path);
+    inode_number = (entry == NULL) ? -1 : entry->inode_number;
+    pthread_mutex_unlock(&path_lock);
+    return inode_number;
+}
+
+// Path_Cache_Lookup without the lock
+Path_Entry *
+Path_Cache_Find(const char *path)
+{
+    Path_Entry *entry = path_cache[Hash_Path(path) % PATH_CACHE_BUCKETS];
+
+    while (entry != NULL && strcmp(path, entry->path) != 0) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+/*
+ * Path_Cache_Add
+ *
+ * Remembers the inode of a directory path.  The cache is simply emptied
+ * when it gets too big.
+ */
+void
+Path_Cache_Add(const char *path, int inode_number)
+{
+    unsigned int bucket = Hash_Path(path) % PATH_CACHE_BUCKETS;
+    Path_Entry *entry;
+
+    pthread_mutex_lock(&path_lock);
+    if (Path_Cache_Find(path) != NULL) {
+        pthread_mutex_unlock(&path_lock);
+        return;
+    }
+    if (path_cache_count >= MAX_PATH_CACHE_ENTRIES) {
+        Free_Path_Cache();
+    }
+
+    if ((entry = malloc(sizeof(Path_Entry))) == NULL) {
+        pthread_mutex_unlock(&path_lock);
+        return;
+    }
+    if ((entry->path = strdup(path)) == NULL) {
+        free(entry);
+        pthread_mutex_unlock(&path_lock);
+        return;
+    }
+    entry->inode_number = inode_number;
+    entry->next = path_cache[bucket];
+    path_cache[bucket] = entry;
+    path_cache_count++;
+    pthread_mutex_unlock(&path_lock);
+}
+
+/*
+ * Flush_Path_Cache
+ *
+ * Empties the path cache.  Called whenever a directory is unlinked, since
+ * any cached path through it (or its reused inode number) is now wrong.
+ */
+void
+Flush_Path_Cache()
+{
+    pthread_mutex_lock(&path_lock);
+    Free_Path_Cache();
+    __atomic_fetch_add(&path_epoch, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&path_lock);
+}
+
+// Flush_Path_Cache without the lock
+void
+Free_Path_Cache()
+{
+    Path_Entry *entry;
+    int i;
+
+    for (i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        while ((entry = path_cache[i]) != NULL) {
+            path_cache[i] = entry->next;
+            free(entry->path);
+            free(entry);
+        }
+    }
+    path_cache_count = 0;
+}
+
+int
+Find_Inode(int inode_number, char *token){
+    int block, slot;
+
+    return Dir_Lookup(inode_number, token, &block, &slot);
+}
+
+/*
+ * Hash_Name
+ *
+ * FNV-1a over a (not necessarily terminated) 16 byte log name.
+ */
+unsigned int
+Hash_Name(const char *name)
+{
+    unsigned int hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < (int) MAX_FILE_SIZE && name[i] != '\0'; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Get_Dir_Cache
+ *
+ * Returns the hash index of a directory's logs, building it with one pass
+ * over the directory's data blocks the first time the directory is looked
+ * at.  Insert_Log and Unlink_File_Log keep it current after that.  Hashed
+ * directories have their index on disk, so theirs stays empty.  The
+ * caller holds the directory's lock; if several readers build it at once
+ * the first one to finish wins and the others throw theirs away.
+ */
+Dir_Cache *
+Get_Dir_Cache(int inode_number)
+{
+    Dir_Cache *dir, *none = NULL;
+    Dir_View view;
+    Inode *inode;
+    int i, j, block;
+
+    if (dir_caches == NULL || inode_number < 0 || inode_number >= dir_cache_slots) {
+        return NULL;
+    }
+    if ((dir = __atomic_load_n(&dir_caches[inode_number], __ATOMIC_ACQUIRE)) != NULL) {
+        return dir;
+    }
+
+    // Only directories have logs to index
+    inode = Pin_Inode(inode_number);
+    if (INODE_TYPE(inode->type) != DIR_FILE) {
+        Unpin_Inode(inode_number, 0);
+        return NULL;
+    }
+    Unpin_Inode(inode_number, 0);
+
+    if ((dir = calloc(1, sizeof(Dir_Cache))) == NULL) {
+        osErrno = E_GENERAL;
+        return NULL;
+    }
+    dir->nbuckets = 16;
+    if ((dir->buckets = calloc(dir->nbuckets, sizeof(Dentry *))) == NULL) {
+        free(dir);
+        osErrno = E_GENERAL;
+        return NULL;
+    }
+
+    inode = Pin_Inode(inode_number);
+    dir->type = inode->type;
+    for (i = 0; !(inode->type & INODE_DIR_HASHED) && (block = Inode_Map_Block(inode_number, inode, i)) != -1; i++) {
+        View_Dir_Block(&view, Get_Block(DATA_BLOCK(block)), inode->type);
+        for (j = Dir_Find_Used(&view, 0); j != -1; j = Dir_Find_Used(&view, j + 1)) {
+            Dcache_Add(dir, view.logs[j].name, view.logs[j].inode_number, block, j);
+        }
+        Put_Block(DATA_BLOCK(block), 0);
+    }
+    Unpin_Inode(inode_number, 0);
+
+    if (!__atomic_compare_exchange_n(&dir_caches[inode_number], &none, dir, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        Free_Dir_Cache(dir);
+        dir = none;
+    }
+    return dir;
+}
+
+Dentry *
+Dcache_Lookup(Dir_Cache *dir, const char *name)
+{
+    Dentry *entry = dir->buckets[Hash_Name(name) & (dir->nbuckets - 1)];
+
+    while (entry != NULL && strncmp(name, entry->name, sizeof(entry->name)) != 0) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+/*
+ * Dcache_Add
+ *
+ * Records that name lives in log slot of data block block.  The table
+ * doubles once it holds more entries than buckets.
+ */
+int
+Dcache_Add(Dir_Cache *dir, const char *name, int inode_number, int block, int slot)
+{
+    Dentry *entry;
+    int i;
+
+    if (dir->count >= dir->nbuckets) {
+        int nbuckets = dir->nbuckets * 2;
+        Dentry **buckets = calloc(nbuckets, sizeof(Dentry *));
+        if (buckets != NULL) {
+            for (i = 0; i < dir->nbuckets; i++) {
+                while ((entry = dir->buckets[i]) != NULL) {
+                    dir->buckets[i] = entry->next;
+                    entry->next = buckets[Hash_Name(entry->name) & (nbuckets - 1)];
+                    buckets[Hash_Name(entry->name) & (nbuckets - 1)] = entry;
+                }
+            }
+            free(dir->buckets);
+            dir->buckets = buckets;
+            dir->nbuckets = nbuckets;
+        }
+    }
+
+    if ((entry = malloc(sizeof(Dentry))) == NULL) {
+        return -1;
+    }
+    strncpy(entry->name, name, sizeof(entry->name));
+    entry->inode_number = inode_number;
+    entry->block = block;
+    entry->slot = slot;
+    entry->next = dir->buckets[Hash_Name(name) & (dir->nbuckets - 1)];
+    dir->buckets[Hash_Name(name) & (dir->nbuckets - 1)] = entry;
+    dir->count++;
+    return 0;
+}
+
+void
+Dcache_Remove(Dir_Cache *dir, const char *name)
+{
+    Dentry **link = &dir->buckets[Hash_Name(name) & (dir->nbuckets - 1)];
+    Dentry *entry;
+
+    while ((entry = *link) != NULL) {
+        if (strncmp(name, entry->name, sizeof(entry->name)) == 0) {
+            *link = entry->next;
+            free(entry);
+            dir->count--;
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+/*
+ * Drop_Dir_Cache
+ *
+ * Forgets the index of a directory (when its inode goes away).  The caller
+ * holds the directory's lock for writing.
+ */
+void
+Drop_Dir_Cache(int inode_number)
+{
+    Dir_Cache *dir;
+
+    if (dir_caches == NULL || inode_number < 0 || inode_number >= dir_cache_slots ||
+        (dir = dir_caches[inode_number]) == NULL) {
+        return;
+    }
+
+    dir_caches[inode_number] = NULL;
+    Free_Dir_Cache(dir);
+}
+
+void
+Free_Dir_Cache(Dir_Cache *dir)
+{
+    Dentry *entry;
+    int i;
+
+    for (i = 0; i < dir->nbuckets; i++) {
+        while ((entry = dir->buckets[i]) != NULL) {
+            dir->buckets[i] = entry->next;
+            free(entry);
+        }
+    }
+    free(dir->buckets);
+    free(dir);
+}
+
+int
+Insert_Log(int parent_inode_num, char *token, int file_type) {
+    Inode *parent;
+    Dir_View view;
+    char *data;
+    int j, i, block, data_block, inode_num, max_blocks;
+    Log log;
+
+    if ((inode_num = Create_Inode(file_type, Inode_Group(parent_inode_num, file_type))) == -1) {
+        return -1;                                  // osErrno is set by Create_Inode
+    }
+    log.inode_number = inode_num;
+    DEBUG_PRINTF("DEBUG: New file inode number is: %d\n", log.inode_number);
+    strncpy(log.name, token, sizeof(log.name));
+
+    parent = Pin_Inode(parent_inode_num);
+    max_blocks = Inode_Max_Blocks(parent);
+
+    for(j = 0; j < max_blocks && !(parent->type & INODE_DIR_HASHED); j++) {
+        if ((block = Inode_Map_Block(parent_inode_num, parent, j)) == -1) {  // if there is no data block associated with this inode block pointer
+            // A tagged directory gets a hash index instead of a second block
+            if (j == 1 && (parent->type & INODE_DIR_TAGS)) {
+                if (Dir_Make_Index(parent_inode_num, parent) == -1) {
+                    break;
+                }
+                continue;
+            }
+            if ((data_block = Alloc_Bit(&data_alloc, Data_Group(parent_inode_num))) == -1) {
+                break;
+            }
+            if (Inode_Add_Block(parent_inode_num, parent, j, data_block) == -1) {
+                Change_Bitmap_Value(&data_alloc, data_block, 0);
+                break;
+            }
+            DEBUG_PRINTF("DEBUG: This file's log is stored on data block: %d\n", data_block);
+
+            // Build the new directory block right on disk
+            data = Get_Block(DATA_BLOCK(data_block));
+            Init_Dir_Block(data, parent->type);
+            View_Dir_Block(&view, data, parent->type);
+            Fill_Dir_Slot(&view, data_block, 0, log.name, log.inode_number, 0);
+            Put_Block(DATA_BLOCK(data_block), 1);
+            Dcache_Note_Insert(parent_inode_num, &log, data_block, 0);
+
+            parent->size += sizeof(Log);
+            Unpin_Inode(parent_inode_num, 1);
+            return data_block;
+        }
+
+        DEBUG_PRINTF("DEBUG: Searching data block %d\n", block);
+        View_Dir_Block(&view, Get_Block(DATA_BLOCK(block)), parent->type);
+
+        if ((i = Dir_Find_Free(&view, 0)) != -1) {
+            DEBUG_PRINTF("DEBUG: Writing to log index %d\n", i);
+            Fill_Dir_Slot(&view, block, i, log.name, log.inode_number, 1);
+            Put_Block(DATA_BLOCK(block), 0);
+            Dcache_Note_Insert(parent_inode_num, &log, block, i);
+            parent->size += sizeof(Log);
+            Unpin_Inode(parent_inode_num, 1);
+            return 0;
+        }
+        Put_Block(DATA_BLOCK(block), 0);
+    }
+
+    if (parent->type & INODE_DIR_HASHED) {
+        if (Dir_Index_Add(parent_inode_num, parent, log.name, log.inode_number) == 0) {
+            parent->size += sizeof(Log);
+            Unpin_Inode(parent_inode_num, 1);
+            return 0;
+        }
+        Unpin_Inode(parent_inode_num, 1);                       // osErrno is set by Dir_Index_Add
+        Change_Bitmap_Value(&inode_alloc, inode_num, 0);
+        return -1;
+    }
+
+    osErrno = E_NO_SPACE;
+    printf("File_Create failed, not enough space in directory.\n");
+    Unpin_Inode(parent_inode_num, 1);                           // may have grown pointer blocks
+    Change_Bitmap_Value(&inode_alloc, inode_num, 0);           // give the new inode back
+    return -1;
+}
+
+/*
+ * Dcache_Note_Insert
+ *
+ * Adds a freshly written log to its directory's index, if the directory has
+ * one yet (otherwise it will be picked up when the index is built).
+ */
+void
+Dcache_Note_Insert(int parent_inode_num, Log *log, int block, int slot)
+{
+    if (dir_caches != NULL && dir_caches[parent_inode_num] != NULL &&
+        Dcache_Add(dir_caches[parent_inode_num], log->name, log->inode_number, block, slot) == -1) {
+        Drop_Dir_Cache(parent_inode_num);       // out of memory, rebuild it on the next lookup
+    }
+}
+
+/*
+ * Init_Dir_Block
+ *
+ * Makes data an empty block of a directory of inode type type.
+ */
+void
+Init_Dir_Block(char *data, int type)
+{
+    Dir_View view;
+    int i;
+
+    memset(data, 0, BLOCK_SIZE);
+    View_Dir_Block(&view, data, type);
+    for (i = 0; i < view.slots; i++) {
+        view.logs[i].inode_number = -1;
+    }
+}
+
+/*
+ * View_Dir_Block
+ *
+ * Sets view up for the block data of a directory of inode type type.
+ */
+void
+View_Dir_Block(Dir_View *view, char *data, int type)
+{
+    if (!(type & INODE_DIR_TAGS)) {
+        view->tags = NULL;
+        view->logs = (Log *) data;
+        view->slots = LOGS_PER_BLOCK;
+        view->log_offset = 0;
+        return;
+    }
+
+    // as many logs as fit with their tags
+    view->slots = sb.block_size / (int) (sizeof(Log) + 1);
+    while ((view->slots + 15) / 16 * 16 + view->slots * (int) sizeof(Log) > sb.block_size) {
+        view->slots--;
+    }
+    view->tags = (unsigned char *) data;
+    view->log_offset = (view->slots + 15) / 16 * 16;
+    view->logs = (Log *) (data + view->log_offset);
+}
+
+/*
+ * Dir_Find_Free, Dir_Find_Used
+ *
+ * The first free (or used) log at or after from, -1 if there is none.
+ */
+int
+Dir_Find_Free(Dir_View *view, int from)
+{
+    if (view->tags != NULL) {
+        return tag_find(view->tags, from, view->slots, 0, 1);
+    }
+    for (; from < view->slots; from++) {
+        if (view->logs[from].inode_number == -1) {
+            return from;
+        }
+    }
+    return -1;
+}
+
+int
+Dir_Find_Used(Dir_View *view, int from)
+{
+    if (view->tags != NULL) {
+        return tag_find(view->tags, from, view->slots, 0, 0);
+    }
+    for (; from < view->slots; from++) {
+        if (view->logs[from].inode_number != -1) {
+            return from;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Dir_Find_Name
+ *
+ * The log holding name, -1 if it isn't in this block.  With tags only the
+ * logs whose tag matches get their names compared.
+ */
+int
+Dir_Find_Name(Dir_View *view, const char *name)
+{
+    int slot, tag;
+
+    if (view->tags == NULL) {
+        for (slot = 0; slot < view->slots; slot++) {
+            if (view->logs[slot].inode_number != -1 &&
+                strncmp(view->logs[slot].name, name, sizeof(view->logs[slot].name)) == 0) {
+                return slot;
+            }
+        }
+        return -1;
+    }
+
+    tag = Name_Tag(name);
+    for (slot = tag_find(view->tags, 0, view->slots, tag, 1); slot != -1;
+         slot = tag_find(view->tags, slot + 1, view->slots, tag, 1)) {
+        if (strncmp(view->logs[slot].name, name, sizeof(view->logs[slot].name)) == 0) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Fill_Dir_Slot, Clear_Dir_Slot
+ *
+ * Puts a name in (or takes it out of) log slot of the directory block
+ * block that view is on, tag included.  Filling marks the change dirty
+ * unless mark is 0 (the whole block is written anyway).
+ */
+void
+Fill_Dir_Slot(Dir_View *view, int block, int slot, const char *name, int inode_number, int mark)
+{
+    strncpy(view->logs[slot].name, name, sizeof(view->logs[slot].name));
+    view->logs[slot].inode_number = inode_number;
+    if (view->tags != NULL) {
+        view->tags[slot] = (unsigned char) Name_Tag(name);
+    }
+    if (mark) {
+        Dirty_Range(DATA_BLOCK(block), view->log_offset + slot * sizeof(Log), sizeof(Log));
+        if (view->tags != NULL) {
+            Dirty_Range(DATA_BLOCK(block), slot, 1);
+        }
+    }
+}
+
+void
+Clear_Dir_Slot(Dir_View *view, int block, int slot)
+{
+    memset(view->logs[slot].name, '-', sizeof(view->logs[slot].name));
+    view->logs[slot].inode_number = -1;
+    Dirty_Range(DATA_BLOCK(block), view->log_offset + slot * sizeof(Log), sizeof(Log));
+    if (view->tags != NULL) {
+        view->tags[slot] = 0;
+        Dirty_Range(DATA_BLOCK(block), slot, 1);
+    }
+}
+
+/*
+ * Dir_Scan
+ *
+ * Looks name up in a directory's blocks themselves, for when there is no
+ * index in memory to ask: a hashed directory's index leads to the one
+ * leaf it can be in, other directories are gone through block by block.
+ * Returns its inode number and where its log is, or -1.  The caller holds
+ * the directory's lock.
+ */
+int
+Dir_Scan(int inode_number, const char *name, int *block, int *slot)
+{
+    Inode *inode = Pin_Inode(inode_number);
+    Dir_Step path[DIR_MAX_LEVELS + 1];
+    Dir_View view;
+    int i, depth, found = -1;
+
+    if (INODE_TYPE(inode->type) == DIR_FILE && (inode->type & INODE_DIR_HASHED)) {
+        *block = Dir_Index_Walk(inode_number, inode, Hash_Name(name), path, &depth);
+        View_Dir_Block(&view, Get_Block(DATA_BLOCK(*block)), inode->type);
+        if ((*slot = Dir_Find_Name(&view, name)) != -1) {
+            found = view.logs[*slot].inode_number;
+        }
+        Put_Block(DATA_BLOCK(*block), 0);
+    } else if (INODE_TYPE(inode->type) == DIR_FILE) {
+        for (i = 0; found == -1 && (*block = Inode_Map_Block(inode_number, inode, i)) != -1; i++) {
+            View_Dir_Block(&view, Get_Block(DATA_BLOCK(*block)), inode->type);
+            if ((*slot = Dir_Find_Name(&view, name)) != -1) {
+                found = view.logs[*slot].inode_number;
+            }
+            Put_Block(DATA_BLOCK(*block), 0);
+        }
+    }
+    Unpin_Inode(inode_number, 0);
+    return found;
+}
+
+/*
+ * Dir_Lookup
+ *
+ * Where name is in a directory: its inode number, with the data block and
+ * log slot holding it, or -1.  The index in memory answers for plain
+ * directories, Dir_Scan for hashed ones (and when there is no memory for
+ * an index).  The caller holds the directory's lock.
+ */
+int
+Dir_Lookup(int inode_number, const char *name, int *block, int *slot)
+{
+    Dir_Cache *dir = Get_Dir_Cache(inode_number);   // hashed copy of the directory's logs
+    Dentry *entry;
+
+    if (dir == NULL || (dir->type & INODE_DIR_HASHED)) {
+        return Dir_Scan(inode_number, name, block, slot);
+    }
+    if ((entry = Dcache_Lookup(dir, name)) == NULL) {
+        return -1;
+    }
+    *block = entry->block;
+    *slot = entry->slot;
+    return entry->inode_number;
+}
+
+/*
+ * Dir_Node_At, Dir_Node_Slots
+ *
+ * The node in an index block of a hashed directory, and how many entries
+ * a node holds.
+ */
+Dir_Node *
+Dir_Node_At(char *data)
+{
+    Dir_View view;
+
+    View_Dir_Block(&view, data, INODE_DIR_TAGS);
+    return (Dir_Node *) view.logs;
+}
+
+int
+Dir_Node_Slots(char *data)
+{
+    int offset = (char *) Dir_Node_At(data) - data;
+
+    return (sb.block_size - offset - (int) sizeof(Dir_Node)) / (int) sizeof(Dir_Index);
+}
+
+/*
+ * Dir_Index_Walk
+ *
+ * Follows a hashed directory's index down to the leaf for hash and returns
+ * its data block.  path gets the node (and entry) of every level, root
+ * first; depth how many there are.
+ */
+int
+Dir_Index_Walk(int inode_number, Inode *inode, unsigned int hash, Dir_Step *path, int *depth)
+{
+    Dir_Node *node;
+    int level, lo, hi, mid, block = Inode_Map_Block(inode_number, inode, 0);
+
+    *depth = 1;
+    for (level = 0; level < *depth; level++) {
+        node = Dir_Node_At(Get_Block(DATA_BLOCK(block)));
+        if (level == 0) {
+            *depth = node->levels + 1;
+        }
+
+        // the last entry whose hash isn't above ours (the first is never)
+        lo = 0;
+        hi = node->count - 1;
+        while (lo < hi) {
+            mid = (lo + hi + 1) / 2;
+            if (node->entries[mid].hash <= hash) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        path[level].block = block;
+        path[level].pos = lo;
+        mid = node->entries[lo].block;
+        Put_Block(DATA_BLOCK(block), 0);
+        block = Inode_Map_Block(inode_number, inode, mid);
+    }
+    return block;
+}
+
+/*
+ * Dir_Make_Index
+ *
+ * Turns a tagged directory whose one block is full into a hashed one: the
+ * block moves to block 1 as the only leaf and block 0 becomes the root.
+ * The caller holds the directory's lock for writing and marks its inode
+ * dirty.
+ */
+int
+Dir_Make_Index(int inode_number, Inode *inode)
+{
+    Dir_Node *root;
+    char *data;
+    int first = Inode_Map_Block(inode_number, inode, 0), leaf;
+
+    if ((leaf = Alloc_Bit(&data_alloc, Data_Group(inode_number))) == -1) {
+        return -1;
+    }
+    if (Inode_Add_Block(inode_number, inode, 1, leaf) == -1) {
+        Change_Bitmap_Value(&data_alloc, leaf, 0);
+        return -1;
+    }
+
+    data = Get_Block(DATA_BLOCK(first));
+    memcpy(Get_Block(DATA_BLOCK(leaf)), data, BLOCK_SIZE);
+    Put_Block(DATA_BLOCK(leaf), 1);
+
+    memset(data, 0, BLOCK_SIZE);
+    root = Dir_Node_At(data);
+    root->count = 1;
+    root->levels = 0;
+    root->blocks = 2;
+    root->entries[0].hash = 0;
+    root->entries[0].block = 1;
+    Put_Block(DATA_BLOCK(first), 1);
+
+    inode->type |= INODE_DIR_HASHED;
+    Drop_Dir_Cache(inode_number);               // its slots are stale, and hashed directories don't use one
+    return 0;
+}
+
+/*
+ * Dir_Index_Add
+ *
+ * Puts a log for name (inode child) in the leaf of a hashed directory its
+ * hash belongs to, splitting the leaf if it is full.  The caller holds the
+ * directory's lock for writing and marks its inode dirty.  Returns 0, or
+ * -1 with osErrno set.
+ */
+int
+Dir_Index_Add(int inode_number, Inode *inode, const char *name, int child)
+{
+    Dir_Step path[DIR_MAX_LEVELS + 1];
+    Dir_View view;
+    unsigned int hash = Hash_Name(name);
+    int leaf, slot, depth;
+
+    leaf = Dir_Index_Walk(inode_number, inode, hash, path, &depth);
+    View_Dir_Block(&view, Get_Block(DATA_BLOCK(leaf)), inode->type);
+    if ((slot = Dir_Find_Free(&view, 0)) == -1) {
+        Put_Block(DATA_BLOCK(leaf), 0);
+        if ((leaf = Dir_Split_Leaf(inode_number, inode, path, depth, leaf, hash)) == -1) {
+            return -1;
+        }
+        View_Dir_Block(&view, Get_Block(DATA_BLOCK(leaf)), inode->type);
+        slot = Dir_Find_Free(&view, 0);
+    }
+    Fill_Dir_Slot(&view, leaf, slot, name, child, 1);
+    Put_Block(DATA_BLOCK(leaf), 0);
+    return 0;
+}
+
+/*
+ * Dir_Split_Leaf
+ *
+ * Moves the upper half (by hash) of a full leaf to a new one and adds it to
+ * the index under the bottom node of path.  The halves are cut where the
+ * hash changes, so all the names with one hash stay in one leaf.  Every
+ * block the split needs is had before anything changes.  Returns the data
+ * block of the half hash now belongs in, or -1 with osErrno set.
+ */
+int
+Dir_Split_Leaf(int inode_number, Inode *inode, Dir_Step *path, int depth, int leaf, unsigned int hash)
+{
+    Dir_Index *order;
+    Dir_View lower, upper;
+    unsigned int split;
+    int i, m, need, added, spare[DIR_MAX_LEVELS + 3];
+
+    if ((order = malloc(LOGS_PER_BLOCK * sizeof(Dir_Index))) == NULL) {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    View_Dir_Block(&lower, Get_Block(DATA_BLOCK(leaf)), inode->type);
+    for (i = 0; i < lower.slots; i++) {
+        order[i].hash = Hash_Name(lower.logs[i].name);
+        order[i].block = i;
+    }
+    qsort(order, lower.slots, sizeof(Dir_Index), Compare_Dir_Index);
+    for (m = lower.slots / 2; m < lower.slots && order[m].hash == order[m - 1].hash; m++)
+        ;
+    if (m == lower.slots) {
+        for (m = lower.slots / 2; m > 0 && order[m].hash == order[m - 1].hash; m--)
+            ;
+    }
+
+    need = Dir_Nodes_Needed(path, depth);
+    if (m == 0 || need == -1 || Dir_New_Blocks(inode_number, inode, need + 1, spare) == -1) {
+        Put_Block(DATA_BLOCK(leaf), 0);
+        free(order);
+        osErrno = E_NO_SPACE;
+        printf("File_Create failed, not enough space in directory.\n");
+        return -1;
+    }
+    split = order[m].hash;
+
+    // The upper half goes to the new leaf, which is written whole
+    added = Inode_Map_Block(inode_number, inode, spare[0]);
+    View_Dir_Block(&upper, Get_Block(DATA_BLOCK(added)), inode->type);
+    for (i = m; i < lower.slots; i++) {
+        Fill_Dir_Slot(&upper, added, i - m, lower.logs[order[i].block].name, lower.logs[order[i].block].inode_number, 0);
+        Clear_Dir_Slot(&lower, leaf, order[i].block);
+    }
+    Put_Block(DATA_BLOCK(added), 1);
+    Put_Block(DATA_BLOCK(leaf), 0);
+    free(order);
+
+    Dir_Node_Insert(inode_number, inode, path, depth, split, spare[0], spare + 1);
+    return (hash >= split) ? added : leaf;
+}
+
+/*
+ * Dir_Nodes_Needed
+ *
+ * How many new node blocks adding an entry under the bottom node of path
+ * takes: one per full node on the way up, and one more if the root is full
+ * too (it grows a level).  -1 if the index can't grow any deeper.
+ */
+int
+Dir_Nodes_Needed(Dir_Step *path, int depth)
+{
+    char *data;
+    int level, full = 1, need = 0;
+
+    for (level = depth - 1; level >= 0 && full; level--) {
+        data = Get_Block(DATA_BLOCK(path[level].block));
+        full = (Dir_Node_At(data)->count == Dir_Node_Slots(data));
+        Put_Block(DATA_BLOCK(path[level].block), 0);
+        need += full;
+    }
+    if (full) {
+        if (depth - 1 == DIR_MAX_LEVELS) {
+            return -1;
+        }
+        need++;
+    }
+    return need;
+}
+
+/*
+ * Dir_New_Blocks
+ *
+ * Adds count empty blocks to a hashed directory and puts their indexes in
+ * out.  If it runs out of space part way, the ones it did get stay in the
+ * inode (as empty blocks past the root's count, to be used next time) and
+ * it returns -1.
+ */
+int
+Dir_New_Blocks(int inode_number, Inode *inode, int count, int *out)
+{
+    int first = Inode_Map_Block(inode_number, inode, 0), i, index, block, ret = 0;
+    char *data = Get_Block(DATA_BLOCK(first));
+    Dir_Node *root = Dir_Node_At(data);
+
+    for (i = 0; i < count; i++) {
+        index = root->blocks + i;
+        if ((block = Inode_Map_Block(inode_number, inode, index)) == -1) {
+            if ((block = Alloc_Bit(&data_alloc, Data_Group(inode_number))) == -1) {
+                ret = -1;
+                break;
+            }
+            if (Inode_Add_Block(inode_number, inode, index, block) == -1) {
+                Change_Bitmap_Value(&data_alloc, block, 0);
+                ret = -1;
+                break;
+            }
+        }
+        Init_Dir_Block(Get_Block(DATA_BLOCK(block)), inode->type);
+        Put_Block(DATA_BLOCK(block), 1);
+        out[i] = index;
+    }
+    if (ret == 0) {
+        root->blocks += count;
+        Dirty_Range(DATA_BLOCK(first), (char *) root - data, sizeof(Dir_Node));
+    }
+    Put_Block(DATA_BLOCK(first), 0);
+    return ret;
+}
+
+/*
+ * Dir_Node_Insert
+ *
+ * Adds the entry (hash, block) right after the one path followed in its
+ * bottom node.  A full node splits in half with a block from spare and
+ * its upper half goes into its parent the same way; a full root first
+ * moves its entries down into a new node and then splits that.
+ */
+void
+Dir_Node_Insert(int inode_number, Inode *inode, Dir_Step *path, int depth, unsigned int hash, int block, int *spare)
+{
+    Dir_Node *node, *upper, *root;
+    char *data, *upper_data;
+    int level, node_block, pos, half, added, grown = 0;
+
+    for (level = depth - 1; level >= 0; level--) {
+        node_block = path[level].block;
+        pos = path[level].pos + 1;
+        data = Get_Block(DATA_BLOCK(node_block));
+        if (Dir_Node_At(data)->count < Dir_Node_Slots(data)) {
+            Dir_Node_Put(data, node_block, pos, hash, block);
+            Put_Block(DATA_BLOCK(node_block), 0);
+            return;
+        }
+
+        if (level == 0) {
+            // the new node takes everything and the root points at it alone
+            root = Dir_Node_At(data);
+            node_block = Inode_Map_Block(inode_number, inode, *spare);
+            data = Get_Block(DATA_BLOCK(node_block));
+            node = Dir_Node_At(data);
+            memset(data, 0, BLOCK_SIZE);
+            node->count = root->count;
+            memcpy(node->entries, root->entries, root->count * sizeof(Dir_Index));
+            root->count = 1;
+            root->entries[0].hash = 0;
+            root->entries[0].block = *spare++;
+            root->levels++;
+            Put_Block(DATA_BLOCK(path[0].block), 1);
+            grown = 1;
+        }
+
+        // the upper half of the node goes to a new one
+        node = Dir_Node_At(data);
+        added = Inode_Map_Block(inode_number, inode, *spare);
+        upper_data = Get_Block(DATA_BLOCK(added));
+        upper = Dir_Node_At(upper_data);
+        half = node->count / 2;
+        memset(upper, 0, sizeof(Dir_Node));
+        upper->count = node->count - half;
+        memcpy(upper->entries, node->entries + half, upper->count * sizeof(Dir_Index));
+        node->count = half;
+        if (pos > half) {
+            Dir_Node_Put(upper_data, added, pos - half, hash, block);
+        } else {
+            Dir_Node_Put(data, node_block, pos, hash, block);
+        }
+        hash = upper->entries[0].hash;
+        block = *spare++;
+        Put_Block(DATA_BLOCK(added), 1);
+        Put_Block(DATA_BLOCK(node_block), 1);
+
+        if (grown) {
+            data = Get_Block(DATA_BLOCK(path[0].block));
+            Dir_Node_Put(data, path[0].block, 1, hash, block);
+            Put_Block(DATA_BLOCK(path[0].block), 0);
+            return;
+        }
+    }
+}
+
+/*
+ * Dir_Node_Put
+ *
+ * Inserts (hash, block) at pos of the node in data, the index block
+ * node_block, which has room for it, and marks what moved.
+ */
+void
+Dir_Node_Put(char *data, int node_block, int pos, unsigned int hash, int block)
+{
+    Dir_Node *node = Dir_Node_At(data);
+
+    memmove(&node->entries[pos + 1], &node->entries[pos], (node->count - pos) * sizeof(Dir_Index));
+    node->entries[pos].hash = hash;
+    node->entries[pos].block = block;
+    node->count++;
+    Dirty_Range(DATA_BLOCK(node_block), (char *) node - data, sizeof(Dir_Node));
+    Dirty_Range(DATA_BLOCK(node_block), (char *) &node->entries[pos] - data,
+                (node->count - pos) * sizeof(Dir_Index));
+}
+
+int
+Compare_Dir_Index(const void *a, const void *b)
+{
+    const Dir_Index *x = a, *y = b;
+
+    return (x->hash > y->hash) - (x->hash < y->hash);
+}
+
+/*
+ * Name_Tag
+ *
+ * The tag of a log holding name: never 0, which marks a free log.
+ */
+int
+Name_Tag(const char *name)
+{
+    return 1 + Hash_Name(name) % 255;
+}
+
+/*
+ * Tag_Find_Scalar, Tag_Find_SSE2, Tag_Find_AVX2
+ *
+ * The first of the n tags at or after from that is (equal 1) or isn't
+ * (equal 0) tag, -1 if none is.  The vector versions load 16 or 32 tags
+ * at a time and may read a little past n, which is still inside the block
+ * (the logs follow the tags).  Pick_Tag_Find sets tag_find to the best one
+ * the CPU runs.
+ */
+int
+Tag_Find_Scalar(const unsigned char *tags, int from, int n, int tag, int equal)
+{
+    for (; from < n; from++) {
+        if ((tags[from] == tag) == equal) {
+            return from;
+        }
+    }
+    return -1;
+}
+
+#if defined(__SSE2__)
+int
+Tag_Find_SSE2(const unsigned char *tags, int from, int n, int tag, int equal)
+{
+    __m128i want = _mm_set1_epi8((char) tag);
+    unsigned int mask;
+
+    for (; from < n; from += 16) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (tags + from)), want));
+        if (!equal) {
+            mask = ~mask & 0xffff;
+        }
+        if (n - from < 16) {
+            mask &= (1u << (n - from)) - 1;
+        }
+        if (mask != 0) {
+            return from + __builtin_ctz(mask);
+        }
+    }
+    return -1;
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) int
+Tag_Find_AVX2(const unsigned char *tags, int from, int n, int tag, int equal)
+{
+    __m256i want = _mm256_set1_epi8((char) tag);
+    unsigned int mask;
+
+    for (; from < n; from += 32) {
+        mask = (unsigned int) _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (tags + from)), want));
+        if (!equal) {
+            mask = ~mask;
+        }
+        if (n - from < 32) {
+            mask &= (1u << (n - from)) - 1;
+        }
+        if (mask != 0) {
+            return from + __builtin_ctz(mask);
+        }
+    }
+    return -1;
+}
+#endif
+
+void
+Pick_Tag_Find()
+{
+    tag_find = Tag_Find_Scalar;
+#if defined(__SSE2__)
+    tag_find = Tag_Find_SSE2;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        tag_find = Tag_Find_AVX2;
+    }
+#endif
+}
+
+int
+Is_In_Directory(int parent_inode_number, char *token)
+{
+    if (Find_Inode(parent_inode_number, token) == -1) {
+        return -1;  // the file does not exist in the directory
+    }
+    return 0;
+}
+
+int
+File_Open(char *file)
+{
+    char name[MAX_FILE_SIZE + 1];
+    int parent, inode_number, fd, type;
+    File_Cache *fc;
+    Inode *inode;
+
+    DEBUG_PRINTF("FS_Open\n");
+    COUNT_OP(FS_OP_OPEN);
+
+    // The parent stays locked so the file can't be unlinked before it is open
+    if ((parent = Lock_Parent(file, name, 0)) == -1) {
+        osErrno = E_NO_SUCH_FILE;
+        printf("File_Open failed, no such file: %s.\n", file);
+        return -1;
+    }
+    if ((inode_number = Find_Inode(parent, name)) == -1) {
+        Unlock_Inode(parent);
+        osErrno = E_NO_SUCH_FILE;
+        printf("File_Open failed, no such file: %s.\n", file);
+        return -1;
+    }
+
+    inode = Pin_Inode(inode_number);
+    type = INODE_TYPE(inode->type);
+    Unpin_Inode(inode_number, 0);
+    if (type != NORM_FILE) {
+        Unlock_Inode(parent);
+        osErrno = E_NO_SUCH_FILE;
+        printf("File_Open failed, %s is a directory.\n", file);
+        return -1;
+    }
+
+    // The first free entry in the open file table is the new fd
+    pthread_mutex_lock(&file_lock);
+    for (fd = 0; fd < MAX_OPEN_FILES && open_files[fd].file != NULL; fd++)
+        ;
+    if (fd == MAX_OPEN_FILES) {
+        pthread_mutex_unlock(&file_lock);
+        Unlock_Inode(parent);
+        osErrno = E_TOO_MANY_OPEN_FILES;
+        printf("File_Open failed, too many open files.\n");
+        return -1;
+    }
+
+    // All fds of a file share one cached inode and buffer
+    if ((fc = Get_File_Cache(inode_number)) == NULL) {
+        pthread_mutex_unlock(&file_lock);
+        Unlock_Inode(parent);
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    fc->refs++;
+
+    open_files[fd].file = fc;
+    open_files[fd].cursor = 0;
+    open_files[fd].next_block = 0;
+    open_files[fd].sequential = 0;
+    pthread_mutex_unlock(&file_lock);
+    Unlock_Inode(parent);
+    return fd;
+}
+
+/*
+ * Get_File_Cache
+ *
+ * Finds the cached inode and buffer of an open file, or sets up new ones.
+ * The caller holds file_lock.
+ */
+File_Cache *
+Get_File_Cache(int inode_number)
+{
+    File_Cache *fc;
+    Inode *inode;
+    int fd;
+
+    for (fd = 0; fd < MAX_OPEN_FILES; fd++) {
+        if (open_files[fd].file != NULL && open_files[fd].file->inode_number == inode_number) {
+            return open_files[fd].file;
+        }
+    }
+
+    if ((fc = calloc(1, sizeof(File_Cache))) == NULL) {
+        return NULL;
+    }
+    if ((fc->buffer = malloc(fd_buffer_blocks * BLOCK_SIZE)) == NULL) {
+        free(fc);
+        return NULL;
+    }
+
+    inode = Pin_Inode(inode_number);
+    memcpy(&fc->inode, inode, sizeof(Inode));
+    Unpin_Inode(inode_number, 0);
+
+    fc->inode_number = inode_number;
+    fc->buf_start = -1;
+    fc->dirty_lo = fd_buffer_blocks;
+    fc->dirty_hi = -1;
+    return fc;
+}
+
+/*
+ * Transfer_Blocks
+ *
+ * Copies count whole blocks of a file, starting at file block index,
+ * between the disk and mem (to_disk picks the direction).  Follows the
+ * inode's extents so every contiguous run is moved in one go.
+ */
+int
+Transfer_Blocks(Inode *inode, int index, int count, char *mem, int to_disk)
+{
+    int block, run;
+
+    while (count > 0) {
+        if ((block = Inode_Run(inode, index, count, &run)) == -1) {
+            return -1;
+        }
+        if (run > count) {
+            run = count;
+        }
+        if (run > sb.group_data_blocks - block % sb.group_data_blocks) {
+            run = sb.group_data_blocks - block % sb.group_data_blocks;     // the next group is further on
+        }
+        if ((to_disk ? Disk_WriteV(DATA_BLOCK(block) * SECTORS_PER_BLOCK, run * SECTORS_PER_BLOCK, mem)
+                     : Disk_ReadV(DATA_BLOCK(block) * SECTORS_PER_BLOCK, run * SECTORS_PER_BLOCK, mem)) == -1) {
+            return -1;
+        }
+        mem += run * BLOCK_SIZE;
+        index += run;
+        count -= run;
+    }
+    return 0;
+}
+
+/*
+ * Window_Flush
+ *
+ * Writes the dirty blocks of a file's buffer back to disk (write-behind).
+ */
+int
+Window_Flush(File_Cache *fc)
+{
+    if (fc->dirty_hi < fc->dirty_lo) {
+        return 0;
+    }
+    if (Transfer_Blocks(&fc->inode, fc->buf_start + fc->dirty_lo, fc->dirty_hi - fc->dirty_lo + 1,
+                        fc->buffer + fc->dirty_lo * BLOCK_SIZE, 1) == -1) {
+        return -1;
+    }
+    fc->dirty_lo = fd_buffer_blocks;
+    fc->dirty_hi = -1;
+    return 0;
+}
+
+/*
+ * Window_Move
+ *
+ * Points a file's (flushed, now empty) buffer at file block start.
+ */
+int
+Window_Move(File_Cache *fc, int start)
+{
+    if (Window_Flush(fc) == -1) {
+        return -1;
+    }
+    fc->buf_start = start;
+    fc->buf_count = 0;
+    return 0;
+}
+
+/*
+ * Window_Fill
+ *
+ * Makes the buffer hold valid data up to (not including) file block upto:
+ * blocks that already have data are read in, whole runs at a time, and the
+ * rest are zeroed.
+ */
+int
+Window_Fill(File_Cache *fc, int upto)
+{
+    int first = fc->buf_start + fc->buf_count;
+    int have = (fc->inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;     // blocks holding file data
+    int read_to = (upto < have) ? upto : have;
+
+    if (upto <= first) {
+        return 0;
+    }
+    if (read_to > first &&
+        Transfer_Blocks(&fc->inode, first, read_to - first, fc->buffer + fc->buf_count * BLOCK_SIZE, 0) == -1) {
+        return -1;
+    }
+    if (upto > read_to && upto > first) {
+        int from = (read_to > first) ? read_to : first;
+        memset(fc->buffer + (from - fc->buf_start) * BLOCK_SIZE, 0, (upto - from) * BLOCK_SIZE);
+    }
+    fc->buf_count = upto - fc->buf_start;
+    return 0;
+}
+
+/*
+ * Note_Access
+ *
+ * Sequential access detection: counts accesses that start where the last one
+ * on this fd ended.
+ */
+void
+Note_Access(Open_File *of, int first_block, int last_block)
+{
+    if (first_block == of->next_block || first_block == of->next_block - 1) {
+        of->sequential++;
+    } else {
+        of->sequential = 0;
+    }
+    of->next_block = last_block + 1;
+}
+
+int
+File_Read(int fd, void *buffer, int size)
+{
+    Open_File *of;
+    int inode_number, ret;
+
+    DEBUG_PRINTF("FS_Read\n");
+    COUNT_OP(FS_OP_READ);
+
+    pthread_mutex_lock(&file_lock);
+    if (fd < 0 || fd >= MAX_OPEN_FILES || (of = &open_files[fd])->file == NULL) {
+        pthread_mutex_unlock(&file_lock);
+        osErrno = E_BAD_FD;
+        return -1;
+    }
+    inode_number = of->file->inode_number;
+    pthread_mutex_unlock(&file_lock);
+
+    // The buffer is shared by every fd of the file, so even reads lock it
+    Lock_Inode(inode_number, 1);
+    ret = Read_Open_File(of, buffer, size);
+    Unlock_Inode(inode_number);
+    return ret;
+}
+
+/*
+ * Read_Open_File
+ *
+ * File_Read once the file is locked.
+ */
+int
+Read_Open_File(Open_File *of, char *out, int size)
+{
+    File_Cache *fc = of->file;
+    int done = 0, block, offset, chunk, upto, blocks;
+
+    // Only read up to the end of the file
+    if (size > fc->inode.size - of->cursor) {
+        size = fc->inode.size - of->cursor;
+    }
+    if (size <= 0) {
+        return 0;
+    }
+    if (fc->inode.type & INODE_INLINE) {
+        memcpy(out, fc->inode.data + of->cursor, size);
+        of->cursor += size;
+        return size;
+    }
+    Note_Access(of, of->cursor / BLOCK_SIZE, (of->cursor + size - 1) / BLOCK_SIZE);
+
+    while (done < size) {
+        block = of->cursor / BLOCK_SIZE;
+        offset = of->cursor % BLOCK_SIZE;
+
+        // Already in the buffer
+        if (fc->buf_start != -1 && block >= fc->buf_start && block < fc->buf_start + fc->buf_count) {
+            chunk = (fc->buf_start + fc->buf_count - block) * BLOCK_SIZE - offset;
+            if (chunk > size - done) {
+                chunk = size - done;
+            }
+            memcpy(out + done, fc->buffer + (block - fc->buf_start) * BLOCK_SIZE + offset, chunk);
+            done += chunk;
+            of->cursor += chunk;
+            continue;
+        }
+
+        // Big aligned reads go straight from the disk to the caller
+        blocks = (size - done) / BLOCK_SIZE;
+        if (offset == 0 && blocks >= fd_buffer_blocks) {
+            if (Window_Flush(fc) == -1 ||
+                Transfer_Blocks(&fc->inode, block, blocks, out + done, 0) == -1) {
+                osErrno = E_GENERAL;
+                return -1;
+            }
+            done += blocks * BLOCK_SIZE;
+            of->cursor += blocks * BLOCK_SIZE;
+            continue;
+        }
+
+        // Otherwise load the buffer.  A sequential reader gets the following
+        // blocks of the file prefetched along with the ones it asked for.
+        upto = (of->cursor + (size - done) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (of->sequential > 0) {
+            upto = block + fd_buffer_blocks;
+        }
+        if (upto > block + fd_buffer_blocks) {
+            upto = block + fd_buffer_blocks;
+        }
+        if (upto > (fc->inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE) {
+            upto = (fc->inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        }
+        if (Window_Move(fc, block) == -1 || Window_Fill(fc, upto) == -1) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+    }
+
+    return done;
+}
+
+int
+File_Write(int fd, void *buffer, int size)
+{
+    Open_File *of;
+    int inode_number, ret, share, done = 0;
+
+    DEBUG_PRINTF("FS_Write\n");
+    COUNT_OP(FS_OP_WRITE);
+
+    pthread_mutex_lock(&file_lock);
+    if (fd < 0 || fd >= MAX_OPEN_FILES || (of = &open_files[fd])->file == NULL) {
+        pthread_mutex_unlock(&file_lock);
+        osErrno = E_BAD_FD;
+        return -1;
+    }
+    inode_number = of->file->inode_number;
+    pthread_mutex_unlock(&file_lock);
+
+    // A write that grows the file by more than one journal piece has room
+    // for goes on in the next one (a bigger one if it got nowhere at all)
+    for (share = journal_op; done < size; ) {
+        Journal_Begin(share);
+        Lock_Inode(inode_number, 1);
+        ret = Write_Open_File(of, (char *) buffer + done, size - done);
+        Unlock_Inode(inode_number);
+        Journal_End();
+        if (ret == -1) {
+            return -1;
+        }
+        if (ret == 0 && share == journal_batch) {
+            osErrno = E_NO_SPACE;
+            printf("File_Write failed, the file can't grow by %d bytes at once.\n", size - done);
+            return -1;
+        }
+        share = (ret == 0) ? journal_batch : journal_op;
+        done += ret;
+    }
+    return done;
+}
+
+/*
+ * Write_Open_File
+ *
+ * File_Write once the file is locked.  Writes less than size (maybe
+ * nothing) if the file has to grow by more blocks than the journal piece
+ * has room for.
+ */
+int
+Write_Open_File(Open_File *of, char *in, int size)
+{
+    File_Cache *fc = of->file;
+    int done = 0, block, offset, chunk, blocks;
+    if (size <= 0) {
+        return 0;
+    }
+
+    // Tiny files live in the inode until a write takes them past it
+    blocks = (of->cursor + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (fc->inode.type & INODE_INLINE) {
+        fc->inode_dirty = 1;
+        if (of->cursor + size <= INLINE_BYTES) {
+            memcpy(fc->inode.data + of->cursor, in, size);
+            of->cursor += size;
+            if (of->cursor > fc->inode.size) {
+                fc->inode.size = of->cursor;
+            }
+            return size;
+        }
+        if (Inline_Grow(fc, blocks) == -1) {
+            printf("File_Write failed, the file can't grow to %d bytes.\n", of->cursor + size);
+            return -1;                              // osErrno set by Inode_Reserve
+        }
+    }
+
+    // Make sure the blocks are there first, as few extents as possible
+    if (blocks > Inode_Block_Count(&fc->inode)) {
+        fc->inode_dirty = 1;
+        if (Inode_Reserve(fc->inode_number, &fc->inode, blocks) == -1) {
+            printf("File_Write failed, the file can't grow to %d bytes.\n", of->cursor + size);
+            return -1;                              // osErrno set by Inode_Reserve
+        }
+        if ((long) Inode_Block_Count(&fc->inode) * BLOCK_SIZE < (long) of->cursor + size) {
+            size = Inode_Block_Count(&fc->inode) * BLOCK_SIZE - of->cursor;
+            if (size <= 0) {
+                return 0;
+            }
+        }
+    }
+    Note_Access(of, of->cursor / BLOCK_SIZE, (of->cursor + size - 1) / BLOCK_SIZE);
+
+    while (done < size) {
+        block = of->cursor / BLOCK_SIZE;
+        offset = of->cursor % BLOCK_SIZE;
+
+        if (fc->buf_start == -1 || block < fc->buf_start || block >= fc->buf_start + fd_buffer_blocks) {
+            // Big aligned writes go straight to the disk, the buffer is
+            // dropped if it held any of those blocks
+            blocks = (size - done) / BLOCK_SIZE;
+            if (offset == 0 && blocks >= fd_buffer_blocks) {
+                if (Window_Flush(fc) == -1 ||
+                    Transfer_Blocks(&fc->inode, block, blocks, in + done, 1) == -1) {
+                    osErrno = E_GENERAL;
+                    return -1;
+                }
+                if (fc->buf_start != -1 && fc->buf_start < block + blocks &&
+                    block < fc->buf_start + fc->buf_count) {
+                    fc->buf_start = -1;
+                }
+                done += blocks * BLOCK_SIZE;
+                of->cursor += blocks * BLOCK_SIZE;
+                if (of->cursor > fc->inode.size) {
+                    fc->inode.size = of->cursor;
+                    fc->inode_dirty = 1;
+                }
+                continue;
+            }
+            if (Window_Move(fc, block) == -1) {
+                osErrno = E_GENERAL;
+                return -1;
+            }
+        }
+
+        chunk = BLOCK_SIZE - offset;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        // A block that is overwritten whole doesn't need reading in first
+        if (block == fc->buf_start + fc->buf_count && chunk == BLOCK_SIZE) {
+            fc->buf_count++;
+        } else if (Window_Fill(fc, block + 1) == -1) {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+
+        memcpy(fc->buffer + (block - fc->buf_start) * BLOCK_SIZE + offset, in + done, chunk);
+        if (block - fc->buf_start < fc->dirty_lo) {
+            fc->dirty_lo = block - fc->buf_start;
+        }
+        if (block - fc->buf_start > fc->dirty_hi) {
+            fc->dirty_hi = block - fc->buf_start;
+        }
+        done += chunk;
+        of->cursor += chunk;
+        if (of->cursor > fc->inode.size) {
+            fc->inode.size = of->cursor;
+            fc->inode_dirty = 1;
+        }
+    }
+
+    return done;
+}
+
+int
+File_Seek(int fd, int offset)
+{
+    DEBUG_PRINTF("FS_Seek\n");
+    COUNT_OP(FS_OP_SEEK);
+
+    int inode_number, size;
+
+    pthread_mutex_lock(&file_lock);
+    if (fd < 0 || fd >= MAX_OPEN_FILES || open_files[fd].file == NULL) {
+        pthread_mutex_unlock(&file_lock);
+        osErrno = E_BAD_FD;
+        return -1;
+    }
+    inode_number = open_files[fd].file->inode_number;
+    pthread_mutex_unlock(&file_lock);
+
+    Lock_Inode(inode_number, 0);
+    size = open_files[fd].file->inode.size;
+    Unlock_Inode(inode_number);
+    if (offset < 0 || offset > size) {
+        osErrno = E_SEEK_OUT_OF_BOUNDS;
+        return -1;
+    }
+
+    open_files[fd].cursor = offset;
+    return offset;
+}
+
+/*
+ * Inline_Grow
+ *
+ * Moves an inline file out of its inode when a write takes it past
+ * INLINE_BYTES: the inode is turned into an extent mapped one with blocks
+ * for the first nblocks file blocks, and what was inline becomes a dirty
+ * block 0 in the buffer (which an inline file never uses), written out
+ * with the rest.  If not even one block can be had the file stays inline.
+ */
+int
+Inline_Grow(File_Cache *fc, int nblocks)
+{
+    Inode old = fc->inode;
+    int ret;
+
+    Init_Inode(&fc->inode, NORM_FILE | INODE_EXTENTS);
+    fc->inode.size = old.size;
+    ret = Inode_Reserve(fc->inode_number, &fc->inode, nblocks);
+    if (Inode_Block_Count(&fc->inode) == 0) {
+        fc->inode = old;
+        return -1;
+    }
+
+    fc->buf_start = 0;
+    fc->buf_count = 1;
+    memset(fc->buffer, 0, BLOCK_SIZE);
+    memcpy(fc->buffer, old.data, old.size);
+    fc->dirty_lo = 0;
+    fc->dirty_hi = 0;
+    return ret;
+}
+
+/*
+ * Flush_File_Cache
+ *
+ * Writes back an open file's buffered blocks and, if it changed, its inode.
+ */
+int
+Flush_File_Cache(File_Cache *fc)
+{
+    Inode *inode;
+
+    if (Window_Flush(fc) == -1) {
+        return -1;
+    }
+    if (fc->inode_dirty) {
+        inode = Pin_Inode(fc->inode_number);
+        memcpy(inode, &fc->inode, sizeof(Inode));
+        Unpin_Inode(fc->inode_number, 1);
+        fc->inode_dirty = 0;
+    }
+    return 0;
+}
+
+int
+File_Close(int fd)
+{
+    File_Cache *fc;
+
+    DEBUG_PRINTF("FS_Close\n");
+    COUNT_OP(FS_OP_CLOSE);
+
+    Journal_Begin(journal_op);
+    pthread_mutex_lock(&file_lock);
+    if (fd < 0 || fd >= MAX_OPEN_FILES || (fc = open_files[fd].file) == NULL) {
+        pthread_mutex_unlock(&file_lock);
+        Journal_End();
+        osErrno = E_BAD_FD;
+        return -1;
+    }
+
+    open_files[fd].file = NULL;
+    if (--fc->refs > 0) {
+        pthread_mutex_unlock(&file_lock);
+        Journal_End();
+        return 0;
+    }
+
+    // Last fd of the file: write everything back (still under file_lock, so
+    // nobody opens it again and reads the inode before it is written)
+    Lock_Inode(fc->inode_number, 1);
+    if (Flush_File_Cache(fc) == -1) {
+        osErrno = E_GENERAL;
+    }
+    Unlock_Inode(fc->inode_number);
+    pthread_mutex_unlock(&file_lock);
+    Journal_End();
+    free(fc->buffer);
+    free(fc);
+    return 0;
+}
+
+/*
+ * Is_Open
+ *
+ * Whether any fd in the open file table refers to inode_number.  The caller
+ * holds file_lock.
+ */
+int
+Is_Open(int inode_number)
+{
+    int fd;
+
+    for (fd = 0; fd < MAX_OPEN_FILES; fd++) {
+        if (open_files[fd].file != NULL && open_files[fd].file->inode_number == inode_number) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int
+File_Unlink(char *file)
+{
+    int ret;
+
+    DEBUG_PRINTF("FS_Unlink\n");
+    COUNT_OP(FS_OP_UNLINK);
+    Journal_Begin(journal_op);
+    ret = Unlink_Entry(file);
+    Journal_End();
+    return ret;
+}
+
+/*
+ * Unlink_Entry
+ *
+ * File_Unlink inside the journal bracket.
+ */
+int
+Unlink_Entry(char *file)
+{
+    char name[MAX_FILE_SIZE + 1];
+    Free_List inodes = { .alloc = &inode_alloc }, blocks = { .alloc = &data_alloc };
+    int parent, inode_number, open;
+
+    if ((parent = Lock_Parent(file, name, 1)) == -1) {
+        // The directory does not exist
+        osErrno = E_NO_SUCH_FILE;
+        printf("File_Unlink failed, no such directory: %s.\n", file);
+        return -1;
+    }
+
+    if ((inode_number = Find_Inode(parent, name)) == -1) {
+        Unlock_Inode(parent);
+        osErrno = E_NO_SUCH_FILE;
+        printf("File_Unlink failed, no such file: %s.\n", name);
+        return -1;
+    }
+
+    // A directory's children would be left behind, that's Dir_Unlink's job
+    if (Is_Dir(inode_number)) {
+        Unlock_Inode(parent);
+        osErrno = E_NO_SUCH_FILE;
+        printf("File_Unlink failed, %s is a directory (use Dir_Unlink or Dir_UnlinkTree).\n", name);
+        return -1;
+    }
+
+    // Can't pull a file out from under an open fd
+    pthread_mutex_lock(&file_lock);
+    open = Is_Open(inode_number);
+    pthread_mutex_unlock(&file_lock);
+    if (open) {
+        Unlock_Inode(parent);
+        osErrno = E_FILE_IN_USE;
+        printf("File_Unlink failed, %s is open.\n", name);
+        return -1;
+    }
+
+    Unlink_File_Log(parent, name, &blocks, &inodes);
+    Unlock_Inode(parent);
+    Free_List_Finish(&blocks, &inodes);
+    return 0;
+}
+
+/*
+ * Unlink_File_Log
+ *
+ * Takes token's log out of a directory and puts the file's blocks and
+ * inode on the lists, for the caller to free once it has let go of the
+ * directory.
+ */
+void
+Unlink_File_Log(int inode_to_search, char *token, Free_List *blocks, Free_List *inodes)
+{
+    int free_this_inode;
+
+    if ((free_this_inode = Remove_Log(inode_to_search, token)) != -1) {
+        Gather_Blocks(free_this_inode, blocks);
+        Free_List_Add(inodes, free_this_inode);
+    }
+}
+
+/*
+ * Remove_Log
+ *
+ * Takes the log of token out of a directory (and its index) and returns
+ * the inode number it held, or -1 if there was none.  The caller holds the
+ * directory's lock for writing.
+ */
+int
+Remove_Log(int parent_inode_num, char *token)
+{
+    Dir_Cache *dir = Get_Dir_Cache(parent_inode_num);
+    Dir_View view;
+    Inode *parent;
+    int inode_number, block, slot;
+
+    // The lookup says exactly which log to clear
+    if ((inode_number = Dir_Lookup(parent_inode_num, token, &block, &slot)) == -1) {
+        return -1;
+    }
+
+    parent = Pin_Inode(parent_inode_num);
+    View_Dir_Block(&view, Get_Block(DATA_BLOCK(block)), parent->type);
+    Clear_Dir_Slot(&view, block, slot);
+    Put_Block(DATA_BLOCK(block), 0);
+    parent->size -= sizeof(Log);                                   // Decrease the size of the parent directory
+    Unpin_Inode(parent_inode_num, 1);
+    if (dir != NULL) {
+        Dcache_Remove(dir, token);
+    }
+    return inode_number;
+}
+
+/*
+ * File_UnlinkBatch
+ *
+ * File_Unlink for count names in the directory dir at once: the directory
+ * is locked once, its logs are cleared a block at a time and the blocks
+ * and inodes are freed with one pass over each bitmap.  Names that aren't there or
+ * are directories (E_NO_SUCH_FILE) or are open (E_FILE_IN_USE) are skipped.  Like File_CreateBatch
+ * it goes in journal pieces.  Returns how many were unlinked, or -1 if dir is no directory.
+ */
+int
+File_UnlinkBatch(char *dir, char **names, int count)
+{
+    int ret, first = 0, piece, done = 0;
+
+    DEBUG_PRINTF("FS_UnlinkBatch %s\n", dir);
+    COUNT_OP(FS_OP_UNLINK_BATCH);
+    do {
+        Journal_Begin(journal_batch);
+        piece = Journal_Items(JOURNAL_NAME_SECTORS);
+        if (piece > count - first) {
+            piece = count - first;
+        }
+        ret = Unlink_Batch(dir, names + first, piece);
+        Journal_End();
+        if (ret == -1) {
+            return (first == 0) ? -1 : done;
+        }
+        done += ret;
+        first += piece;
+    } while (first < count);
+    return done;
+}
+
+int
+Unlink_Batch(char *path, char **names, int count)
+{
+    Batch_Entry *entries;
+    Free_List inodes = { .alloc = &inode_alloc }, blocks = { .alloc = &data_alloc };
+    Dir_Cache *dir;
+    Inode *parent_inode;
+    Dir_View view;
+    int parent, i, j, n = 0;
+
+    if ((parent = Lock_Dir(path, 1)) == -1) {
+        osErrno = E_NO_SUCH_FILE;
+        printf("File_UnlinkBatch failed, no such directory: %s.\n", path);
+        return -1;
+    }
+    dir = Get_Dir_Cache(parent);
+    if (count <= 0) {
+        Unlock_Inode(parent);
+        return 0;
+    }
+    if ((entries = malloc(count * sizeof(Batch_Entry))) == NULL) {
+        Unlock_Inode(parent);
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    // Find every log first
+    pthread_mutex_lock(&file_lock);
+    for (i = 0; i < count; i++) {
+        if (!Valid_Name(names[i]) ||
+            (entries[n].inode_number = Dir_Lookup(parent, names[i], &entries[n].block, &entries[n].slot)) == -1) {
+            osErrno = E_NO_SUCH_FILE;
+            printf("File_UnlinkBatch failed, no such file: %.*s.\n", (int) MAX_FILE_SIZE, names[i]);
+            continue;
+        }
+        if (Is_Dir(entries[n].inode_number)) {
+            osErrno = E_NO_SUCH_FILE;
+            printf("File_UnlinkBatch failed, %s is a directory (use Dir_Unlink or Dir_UnlinkTree).\n", names[i]);
+            continue;
+        }
+        if (Is_Open(entries[n].inode_number)) {
+            osErrno = E_FILE_IN_USE;
+            printf("File_UnlinkBatch failed, %s is open.\n", names[i]);
+            continue;
+        }
+        entries[n].name = names[i];
+        n++;
+        Dcache_Remove(dir, names[i]);
+    }
+    pthread_mutex_unlock(&file_lock);
+
+    // A name given twice is only unlinked once (hashed directories find it again)
+    qsort(entries, n, sizeof(Batch_Entry), Compare_Batch_Slot);
+    for (i = 0, j = 0; i < n; i++) {
+        if (j == 0 || Compare_Batch_Slot(&entries[j - 1], &entries[i]) != 0) {
+            entries[j++] = entries[i];
+        }
+    }
+    n = j;
+
+    // Clear the logs, each directory block pinned once
+    for (i = 0; i < n; i = j) {
+        View_Dir_Block(&view, Get_Block(DATA_BLOCK(entries[i].block)), dir->type);
+        for (j = i; j < n && entries[j].block == entries[i].block; j++) {
+            Clear_Dir_Slot(&view, entries[j].block, entries[j].slot);
+        }
+        Put_Block(DATA_BLOCK(entries[i].block), 0);
+    }
+
+    // Their blocks, then the inodes
+    for (i = 0; i < n; i++) {
+        Gather_Blocks(entries[i].inode_number, &blocks);
+        Free_List_Add(&inodes, entries[i].inode_number);
+    }
+
+    parent_inode = Pin_Inode(parent);
+    parent_inode->size -= n * sizeof(Log);
+    Unpin_Inode(parent, 1);
+    Unlock_Inode(parent);
+    Free_List_Finish(&blocks, &inodes);
+
+    DEBUG_PRINTF("DEBUG: Unlinked %d of %d files in %s\n", n, count, path);
+    free(entries);
+    return n;
+}
+
+// directory ops
+int
+Dir_Create(char *file)
+{
+    int ret;
+
+    DEBUG_PRINTF("Dir_Create %s\n", file);
+    COUNT_OP(FS_OP_DIR_CREATE);
+    Journal_Begin(journal_op);
+    ret = Create_Entry(file, DIR_FILE);
+    Journal_End();
+    return ret;
+}
+
+int
+Dir_Size(char *path)
+{
+    Inode *inode;
+    int dir, size;
+
+    DEBUG_PRINTF("Dir_Size\n");
+    COUNT_OP(FS_OP_DIR_SIZE);
+
+    if ((dir = Lock_Dir(path, 0)) == -1) {
+        osErrno = E_NO_SUCH_FILE;
+        printf("Dir_Size failed, no such directory: %s.\n", path);
+        return -1;
+    }
+
+    // One Log per entry, and a Dir_Entry is the same 20 bytes
+    inode = Pin_Inode(dir);
+    size = inode->size / (int) sizeof(Log) * (int) sizeof(Dir_Entry);
+    Unpin_Inode(dir, 0);
+    Unlock_Inode(dir);
+    return size;
+}
+
+int
+Dir_Read(char *path, void *buffer, int size)
+{
+    Inode *inode;
+    int dir, count, index = 0, slot = 0;
+
+    DEBUG_PRINTF("Dir_Read\n");
+    COUNT_OP(FS_OP_DIR_READ);
+
+    if ((dir = Lock_Dir(path, 0)) == -1) {
+        osErrno = E_NO_SUCH_FILE;
+        printf("Dir_Read failed, no such directory: %s.\n", path);
+        return -1;
+    }
+
+    inode = Pin_Inode(dir);
+    count = inode->size / (int) sizeof(Log);
+    Unpin_Inode(dir, 0);
+    if (size < count * (int) sizeof(Dir_Entry)) {
+        Unlock_Inode(dir);
+        osErrno = E_BUFFER_TOO_SMALL;
+        printf("Dir_Read failed, %d entries need %d bytes.\n", count, count * (int) sizeof(Dir_Entry));
+        return -1;
+    }
+
+    count = Dir_Walk(dir, &index, &slot, (Dir_Entry *) buffer, count);
+    Unlock_Inode(dir);
+    return count;
+}
+
+/*
+ * Dir_Open
+ *
+ * Starts a listing of the directory path, to be read with Dir_Next as
+ * many entries at a time as the caller's buffer holds.  Returns a handle
+ * for Dir_Next and Dir_Close.
+ */
+int
+Dir_Open(char *path)
+{
+    int dir, dd;
+
+    DEBUG_PRINTF("Dir_Open %s\n", path);
+    COUNT_OP(FS_OP_DIR_OPEN);
+
+    if ((dir = Lock_Dir(path, 0)) == -1) {
+        osErrno = E_NO_SUCH_FILE;
+        printf("Dir_Open failed, no such directory: %s.\n", path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&file_lock);
+    for (dd = 0; dd < MAX_OPEN_DIRS && open_dirs[dd].inode_number != -1; dd++)
+        ;
+    if (dd == MAX_OPEN_DIRS) {
+        pthread_mutex_unlock(&file_lock);
+        Unlock_Inode(dir);
+        osErrno = E_TOO_MANY_OPEN_FILES;
+        printf("Dir_Open failed, too many open directories.\n");
+        return -1;
+    }
+    open_dirs[dd].inode_number = dir;
+    open_dirs[dd].index = 0;
+    open_dirs[dd].slot = 0;
+    pthread_mutex_unlock(&file_lock);
+    Unlock_Inode(dir);
+    return dd;
+}
+
+/*
+ * Dir_Next
+ *
+ * Fills buffer with as many of the next entries of an open directory as
+ * fit in size bytes and returns how many that was, 0 once the listing is
+ * done.  Entries added or removed meanwhile may or may not show up.
+ */
+int
+Dir_Next(int dd, void *buffer, int size)
+{
+    Dir_Cursor *cursor;
+    int count;
+
+    COUNT_OP(FS_OP_DIR_NEXT);
+
+    if (dd < 0 || dd >= MAX_OPEN_DIRS || (cursor = &open_dirs[dd])->inode_number == -1) {
+        osErrno = E_BAD_FD;
+        return -1;
+    }
+    if (size < (int) sizeof(Dir_Entry)) {
+        osErrno = E_BUFFER_TOO_SMALL;
+        return -1;
+    }
+
+    // The directory may have been unlinked since it was opened
+    Lock_Inode(cursor->inode_number, 0);
+    if (!Inode_In_Use(cursor->inode_number) || !Is_Dir(cursor->inode_number)) {
+        Unlock_Inode(cursor->inode_number);
+        osErrno = E_NO_SUCH_FILE;
+        return -1;
+    }
+    count = Dir_Walk(cursor->inode_number, &cursor->index, &cursor->slot,
+                     (Dir_Entry *) buffer, size / (int) sizeof(Dir_Entry));
+    Unlock_Inode(cursor->inode_number);
+    return count;
+}
+
+int
+Dir_Close(int dd)
+{
+    DEBUG_PRINTF("Dir_Close\n");
+    COUNT_OP(FS_OP_DIR_CLOSE);
+
+    pthread_mutex_lock(&file_lock);
+    if (dd < 0 || dd >= MAX_OPEN_DIRS || open_dirs[dd].inode_number == -1) {
+        pthread_mutex_unlock(&file_lock);
+        osErrno = E_BAD_FD;
+        return -1;
+    }
+    open_dirs[dd].inode_number = -1;
+    pthread_mutex_unlock(&file_lock);
+    return 0;
+}
+
+/*
+ * Dir_Walk
+ *
+ * Copies up to max entries of a directory into out, going on from block
+ * index *index, log *slot, and moves the position past them.  Free logs
+ * are skipped over, not copied.  Returns how many entries it copied.  The
+ * caller holds the directory's lock.
+ */
+int
+Dir_Walk(int inode_number, int *index, int *slot, Dir_Entry *out, int max)
+{
+    Inode *inode = Pin_Inode(inode_number);
+    Dir_View view;
+    int block, n = 0;
+
+    while (n < max && (block = Inode_Map_Block(inode_number, inode, *index)) != -1) {
+        View_Dir_Block(&view, Get_Block(DATA_BLOCK(block)), inode->type);
+        while (n < max && (*slot = Dir_Find_Used(&view, *slot)) != -1) {
+            memcpy(&out[n++], &view.logs[*slot], sizeof(Dir_Entry));
+            (*slot)++;
+        }
+        Put_Block(DATA_BLOCK(block), 0);
+        if (*slot == -1 || *slot == view.slots) {
+            (*index)++;
+            *slot = 0;
+        }
+    }
+    Unpin_Inode(inode_number, 0);
+    return n;
+}
+
+/*
+ * Dir_Unlink, Dir_UnlinkTree
+ *
+ * Removes the directory path, which Dir_Unlink wants empty
+ * (E_DIR_NOT_EMPTY) and Dir_UnlinkTree takes down with everything under
+ * it.  Fails with nothing changed if a file in it is open
+ * (E_FILE_IN_USE).  The root can't go (E_ROOT_DIR).
+ */
+int
+Dir_Unlink(char *path)
+{
+    int ret;
+
+    DEBUG_PRINTF("Dir_Unlink\n");
+    COUNT_OP(FS_OP_DIR_UNLINK);
+    Journal_Begin(journal_op);
+    ret = Unlink_Dir(path, 0);
+    Journal_End();
+    return ret;
+}
+
+int
+Dir_UnlinkTree(char *path)
+{
+    int ret;
+
+    DEBUG_PRINTF("Dir_UnlinkTree %s\n", path);
+    COUNT_OP(FS_OP_DIR_UNLINK_TREE);
+    Journal_Begin(journal_op);
+    ret = Unlink_Dir(path, 1);
+    Journal_End();
+    return ret;
+}
+
+/*
+ * Unlink_Dir
+ *
+ * Dir_Unlink (recursive 0) and Dir_UnlinkTree inside the journal bracket.
+ * Once the tree is locked and checked, the directory's log goes and the
+ * blocks, then the inodes, of everything in it are freed with one pass
+ * over each bitmap, so taking down a big tree costs about one write per
+ * bitmap sector it touches.  (That happens after the tree is let go of,
+ * in more than one journal piece if it has to, see Free_List_Finish.)
+ */
+int
+Unlink_Dir(char *path, int recursive)
+{
+    char name[MAX_FILE_SIZE + 1];
+    Free_List inodes = { .alloc = &inode_alloc }, blocks = { .alloc = &data_alloc };
+    Dir_Entry entries[DIR_WALK_ENTRIES];
+    Inode *inode;
+    int *dirs, ndirs, parent, dir, i, j, n, index, slot;
+
+    if (path[strspn(path, "/")] == '\0') {
+        osErrno = E_ROOT_DIR;
+        printf("Dir_Unlink failed, the root directory can't be unlinked.\n");
+        return -1;
+    }
+    if ((parent = Lock_Parent(path, name, 1)) == -1 ||
+        (dir = Find_Inode(parent, name)) == -1 || !Is_Dir(dir)) {
+        if (parent != -1) {
+            Unlock_Inode(parent);
+        }
+        osErrno = E_NO_SUCH_FILE;
+        printf("Dir_Unlink failed, no such directory: %s.\n", path);
+        return -1;
+    }
+
+    Lock_Inode(dir, 1);
+    inode = Pin_Inode(dir);
+    n = inode->size;
+    Unpin_Inode(dir, 0);
+    if (!recursive && n > 0) {
+        Unlock_Inode(dir);
+        Unlock_Inode(parent);
+        osErrno = E_DIR_NOT_EMPTY;
+        printf("Dir_Unlink failed, %s is not empty.\n", path);
+        return -1;
+    }
+    if ((ndirs = Lock_Tree(dir, &dirs)) == -1) {
+        Unlock_Inode(parent);
+        return -1;                                  // osErrno is set by Lock_Tree
+    }
+
+    Remove_Log(parent, name);
+
+    // Everything in the tree goes (the files are in the logs of the directories)
+    for (i = 0; i < ndirs; i++) {
+        index = slot = 0;
+        while ((n = Dir_Walk(dirs[i], &index, &slot, entries, DIR_WALK_ENTRIES)) > 0) {
+            for (j = 0; j < n; j++) {
+                if (!Is_Dir(entries[j].inode_number)) {
+                    Gather_Blocks(entries[j].inode_number, &blocks);
+                    Free_List_Add(&inodes, entries[j].inode_number);
+                }
+            }
+        }
+        Gather_Blocks(dirs[i], &blocks);
+        Free_List_Add(&inodes, dirs[i]);
+        Drop_Dir_Cache(dirs[i]);
+        Drop_Bmap(dirs[i]);
+    }
+    Flush_Path_Cache();
+
+    for (i = ndirs - 1; i >= 0; i--) {
+        Unlock_Inode(dirs[i]);
+    }
+    Unlock_Inode(parent);
+    free(dirs);
+    Free_List_Finish(&blocks, &inodes);
+    return 0;
+}
+
+/*
+ * Lock_Tree
+ *
+ * Locks every directory under dir (locked for writing already) for
+ * writing as well, parents before children, and makes sure none of the
+ * files in them is open.  Returns how many directories there are, dir
+ * included, with their inode numbers in *dirs (to be freed), or -1 with
+ * all of them unlocked again, dir too.
+ */
+int
+Lock_Tree(int dir, int **dirs)
+{
+    Dir_Entry entries[DIR_WALK_ENTRIES];
+    int *list, *grown, ndirs = 1, max = 16, i, j, n, index, slot, open = 0;
+
+    if ((list = malloc(max * sizeof(int))) == NULL) {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    list[0] = dir;
+
+    for (i = 0; i < ndirs && !open; i++) {
+        index = slot = 0;
+        while (!open && (n = Dir_Walk(list[i], &index, &slot, entries, DIR_WALK_ENTRIES)) > 0) {
+            for (j = 0; j < n && !open; j++) {
+                if (!Is_Dir(entries[j].inode_number)) {
+                    pthread_mutex_lock(&file_lock);
+                    open = Is_Open(entries[j].inode_number);
+                    pthread_mutex_unlock(&file_lock);
+                    continue;
+                }
+                if (ndirs == max) {
+                    if ((grown = realloc(list, 2 * max * sizeof(int))) == NULL) {
+                        open = -1;
+                        break;
+                    }
+                    list = grown;
+                    max *= 2;
+                }
+                Lock_Inode(entries[j].inode_number, 1);
+                list[ndirs++] = entries[j].inode_number;
+            }
+        }
+    }
+
+    if (open) {
+        for (i = ndirs - 1; i > 0; i--) {
+            Unlock_Inode(list[i]);
+        }
+        Unlock_Inode(dir);
+        free(list);
+        osErrno = (open == -1) ? E_GENERAL : E_FILE_IN_USE;
+        printf("Dir_Unlink failed, %s.\n", (open == -1) ? "out of memory" : "a file in the tree is open");
+        return -1;
+    }
+    *dirs = list;
+    return ndirs;
+}
+
+/*
+ * Create_Inode
+ *
+ * Allocates and initializes a new inode of the given type, from allocation
+ * group group if it has room (see Inode_Group).
+ */
+int
+Create_Inode(int type, int group)
+{
+    int offset;
+    Inode *node;
+
+    // Determine the inode offset value (from index 0 in the inode bitmap)
+    // and claim it before anyone else can
+    if ((offset = Alloc_Bit(&inode_alloc, group)) == -1)
+    {
+        osErrno = E_NO_SPACE;
+        printf("Create_Inode() failed, disk space full.\n");
+        return -1;
+    } else {
+        DEBUG_PRINTF("DEBUG: This inode's bitmap location is: %d\n", (unsigned) offset);
+    }
+
+    // Initialize the inode right where it lives on disk
+    node = Pin_Inode(offset);
+    Init_Inode(node, type);
+    Unpin_Inode(offset, 1);
+
+    return offset;
+}
+
+/*
+ * Init_Inode
+ *
+ * Makes node an empty inode of the given type.  Files start out inline, and
+ * when they outgrow that (see Inline_Grow) map their data with extents so
+ * big writes can land in one contiguous run (and with blocks, like a
+ * directory, once free space is too broken up for that).
+ */
+void
+Init_Inode(Inode *node, int type)
+{
+    int i;
+
+    node->size = 0;
+    node->type = type;
+    if (type == NORM_FILE) {
+        node->type |= INODE_INLINE;
+        memset(node->data, 0, INLINE_BYTES);
+    } else if (type == (NORM_FILE | INODE_EXTENTS)) {
+        for (i = 0; i < MAX_INODE_EXTENTS; i++) {
+            node->extents[i].start = -1;
+            node->extents[i].length = 0;
+        }
+    } else {
+        node->type |= INODE_INDIRECT | INODE_DIR_TAGS;
+        for (i = 0; i < MAX_INODE_BLOCKS; i++) {
+            node->blocks[i] = -1;
+        }
+    }
+}
+
+/*
+ * Pin_Inode
+ *
+ * Pins the inode table sector holding inode_number and returns a pointer to
+ * the inode inside it, so it can be read or changed in place.  Every call
+ * must be matched by an Unpin_Inode.
+ */
+Inode *
+Pin_Inode(int inode_number)
+{
+    char *sec = Disk_Get(Inode_Sector(inode_number));
+    return (Inode *) (sec + (inode_number % (SECTOR_SIZE / sizeof(Inode))) * sizeof(Inode));
+}
+
+void
+Unpin_Inode(int inode_number, int dirty)
+{
+    if (dirty) {
+        Journal_Note(Inode_Sector(inode_number), 1);
+    }
+    Disk_Put(Inode_Sector(inode_number), dirty);
+}
+
+/*
+ * Inode_Sector
+ *
+ * The sector an inode lives in.  Inodes never straddle sectors, so only
+ * that one sector is pinned (and written back) for an inode, however big
+ * the blocks are.
+ */
+int
+Inode_Sector(int inode_number)
+{
+    return GROUP_INODES(inode_number / sb.group_inodes) * SECTORS_PER_BLOCK +
+           (inode_number % sb.group_inodes) / (SECTOR_SIZE / sizeof(Inode));
+}
+
+/*
+ * Lock_Inode
+ *
+ * Takes an inode's lock, shared or (write nonzero) exclusive.  See LOCKS
+ * for the order locks have to be taken in.
+ */
+void
+Lock_Inode(int inode_number, int write)
+{
+    if (write) {
+        pthread_rwlock_wrlock(&inode_locks[inode_number]);
+    } else {
+        pthread_rwlock_rdlock(&inode_locks[inode_number]);
+    }
+}
+
+void
+Unlock_Inode(int inode_number)
+{
+    pthread_rwlock_unlock(&inode_locks[inode_number]);
+}
+
+/*
+ * Inode_In_Use
+ *
+ * Whether inode_number is allocated.
+ */
+int
+Inode_In_Use(int inode_number)
+{
+    Alloc_Group *group = &inode_alloc.groups[inode_number / inode_alloc.group_bits];
+    int used;
+
+    pthread_mutex_lock(&group->lock);
+    used = (inode_alloc.words[inode_number / 64] >> (inode_number % 64)) & 1;
+    pthread_mutex_unlock(&group->lock);
+    return used;
+}
+
+/*
+ * Is_Dir
+ *
+ * Whether inode_number is a directory.  An inode's type only changes when
+ * it is unlinked, so holding its parent's lock is enough to ask.
+ */
+int
+Is_Dir(int inode_number)
+{
+    Inode *inode = Pin_Inode(inode_number);
+    int type = INODE_TYPE(inode->type);
+
+    Unpin_Inode(inode_number, 0);
+    return type == DIR_FILE;
+}
+
+/*
+ * Load_Bitmap
+ *
+ * Builds an allocator from the on-disk bitmap that starts at block start and
+ * covers nbits blocks.  On disk bit 0 is the high bit of byte 0; in memory
+ * block i is bit (i % 64) of word (i / 64) so a whole word of allocated
+ * blocks can be skipped at once and the first free bit found with ctz.
+ * The padding bits past nbits are marked allocated so they never come back.
+ *
+ * The bitmap is split into allocation groups of group_bits each (a multiple
+ * of 64), or if that is 0 into up to MAX_ALLOC_GROUPS of at least
+ * min_group_bits each, on word boundaries.  Each has its own free count,
+ * cursor and lock.
+ */
+int
+Load_Bitmap(Bitmap_Alloc *alloc, int start, int nbits, int min_group_bits, int group_bits)
+{
+    int i, j, g;
+    unsigned char *bitmap;
+
+    for (g = 0; g < alloc->ngroups; g++) {
+        pthread_mutex_destroy(&alloc->groups[g].lock);
+    }
+    free(alloc->groups);
+    free(alloc->words);
+    alloc->nbits = nbits;
+    alloc->nwords = (nbits + 63) / 64;
+    alloc->words = calloc(alloc->nwords, sizeof(uint64_t));
+    alloc->start = start;
+
+    alloc->ngroups = nbits / min_group_bits;
+    if (alloc->ngroups > MAX_ALLOC_GROUPS) {
+        alloc->ngroups = MAX_ALLOC_GROUPS;
+    } else if (alloc->ngroups < 1) {
+        alloc->ngroups = 1;
+    }
+    alloc->group_bits = (group_bits > 0) ? group_bits : ((nbits + alloc->ngroups - 1) / alloc->ngroups + 63) / 64 * 64;
+    alloc->ngroups = (nbits + alloc->group_bits - 1) / alloc->group_bits;
+    alloc->groups = calloc(alloc->ngroups, sizeof(Alloc_Group));
+    if (alloc->words == NULL || alloc->groups == NULL) {
+        alloc->ngroups = 0;
+        return -1;
+    }
+    for (g = 0; g < alloc->ngroups; g++) {
+        alloc->groups[g].first = g * alloc->group_bits;
+        alloc->groups[g].nbits = (g == alloc->ngroups - 1) ? nbits - alloc->groups[g].first : alloc->group_bits;
+        alloc->groups[g].cursor = alloc->groups[g].first / 64;
+        pthread_mutex_init(&alloc->groups[g].lock, NULL);
+    }
+
+    for (i = 0; i < nbits; i += 8) {
+        if (i % (BLOCK_SIZE * 8) == 0) {
+            bitmap = (unsigned char *) Get_Block(start + i / (BLOCK_SIZE * 8));
+        }
+        unsigned char current = bitmap[(i / 8) % BLOCK_SIZE];
+        for (j = 0; j < 8 && i + j < nbits; j++) {
+            if (current & (128 >> j)) {
+                alloc->words[(i + j) / 64] |= (uint64_t) 1 << ((i + j) % 64);
+            } else {
+                alloc->groups[(i + j) / alloc->group_bits].free_count++;
+            }
+        }
+        if ((i + 8) % (BLOCK_SIZE * 8) == 0 || i + 8 >= nbits) {
+            Put_Block(start + i / (BLOCK_SIZE * 8), 0);
+        }
+    }
+
+    if (nbits % 64 != 0) {
+        alloc->words[alloc->nwords - 1] |= ~(uint64_t) 0 << (nbits % 64);
+    }
+    return 0;
+}
+
+/*
+ * Find_Free_Bit
+ *
+ * Next fit within group g: starts at the word the last search stopped in
+ * and wraps around the group once, a word at a time.  The caller holds the
+ * group's lock.  Doesn't claim the bit, Set_Bits does.
+ */
+int
+Find_Free_Bit(Bitmap_Alloc *alloc, int g)
+{
+    Alloc_Group *group = &alloc->groups[g];
+    int first = group->first / 64;
+    int nwords = (group->nbits + 63) / 64;
+    int i, w;
+
+    COUNT(alloc_searches, 1);
+    for (i = 0; group->free_count > 0 && i < nwords; i++) {
+        w = first + (group->cursor - first + i) % nwords;
+        if (alloc->words[w] != ~(uint64_t) 0) {
+            group->cursor = w;
+            return w * 64 + __builtin_ctzll(~alloc->words[w]);
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Alloc_Bit
+ *
+ * Finds and claims a free bit, preferring allocation group g and moving on
+ * to the next groups when it is full.  Only one group is locked at a time.
+ * Returns the bit, or -1 if every group is full.
+ */
+int
+Alloc_Bit(Bitmap_Alloc *alloc, int g)
+{
+    int i, bit = -1;
+
+    for (i = 0; bit == -1 && i < alloc->ngroups; i++) {
+        Alloc_Group *group = &alloc->groups[(g + i) % alloc->ngroups];
+
+        pthread_mutex_lock(&group->lock);
+        if ((bit = Find_Free_Bit(alloc, (g + i) % alloc->ngroups)) != -1) {
+            Set_Bits(alloc, bit, 1, 1);
+        }
+        pthread_mutex_unlock(&group->lock);
+    }
+    return bit;
+}
+
+/*
+ * Alloc_Bits
+ *
+ * Alloc_Bit for count bits at once.  They are taken a free run at a time,
+ * so each bitmap sector is written once per run, from group g on as
+ * groups fill up.  The bits go in out; returns how many it got.
+ */
+int
+Alloc_Bits(Bitmap_Alloc *alloc, int g, int count, int *out)
+{
+    int i, k, start, length, got = 0;
+
+    for (i = 0; got < count && i < alloc->ngroups; i++) {
+        Alloc_Group *group = &alloc->groups[(g + i) % alloc->ngroups];
+
+        pthread_mutex_lock(&group->lock);
+        while (got < count &&
+               (start = Find_Free_Extent(alloc, (g + i) % alloc->ngroups, count - got, &length)) != -1) {
+            Set_Bits(alloc, start, length, 1);
+            for (k = 0; k < length; k++) {
+                out[got++] = start + k;
+            }
+        }
+        pthread_mutex_unlock(&group->lock);
+    }
+    return got;
+}
+
+/*
+ * Lock_Groups
+ *
+ * Locks every allocation group the count bits from offset fall in, lowest
+ * group first (the order group locks are always taken in).
+ */
+void
+Lock_Groups(Bitmap_Alloc *alloc, int offset, int count)
+{
+    int g;
+
+    for (g = offset / alloc->group_bits; g <= (offset + count - 1) / alloc->group_bits; g++) {
+        pthread_mutex_lock(&alloc->groups[g].lock);
+    }
+}
+
+void
+Unlock_Groups(Bitmap_Alloc *alloc, int offset, int count)
+{
+    int g;
+
+    for (g = offset / alloc->group_bits; g <= (offset + count - 1) / alloc->group_bits; g++) {
+        pthread_mutex_unlock(&alloc->groups[g].lock);
+    }
+}
+
+/*
+ * Set_Bits
+ *
+ * Sets (value 1) or clears (value 0) count bits starting at offset, both in
+ * the allocator and on disk.  Each bitmap sector the range covers is pinned
+ * and written once; with big blocks that is still only the sectors that
+ * actually changed.  The caller holds the locks of the groups involved.
+ */
+void
+Set_Bits(Bitmap_Alloc *alloc, int offset, int count, int value)
+{
+    int sec = alloc->start * SECTORS_PER_BLOCK;
+    int i, bitmap_sec = -1, changed = 0;
+    char *bitmap = NULL;
+
+    for (i = offset; i < offset + count; i++) {
+        uint64_t bit = (uint64_t) 1 << (i % 64);
+
+        // Keep the allocator's copy and free counts in step
+        if (value && !(alloc->words[i / 64] & bit)) {
+            alloc->words[i / 64] |= bit;
+            alloc->groups[i / alloc->group_bits].free_count--;
+            changed++;
+        } else if (!value && (alloc->words[i / 64] & bit)) {
+            alloc->words[i / 64] &= ~bit;
+            alloc->groups[i / alloc->group_bits].free_count++;
+            changed++;
+        }
+
+        // The bitmap is sprawled along several sectors
+        if (sec + i / (SECTOR_SIZE * 8) != bitmap_sec) {
+            if (bitmap != NULL) {
+                Journal_Note(bitmap_sec, 1);
+                Disk_Put(bitmap_sec, 1);            // Write the change
+            }
+            bitmap_sec = sec + i / (SECTOR_SIZE * 8);
+            bitmap = Disk_Get(bitmap_sec);
+        }
+
+        // Find which byte needs changed, on disk bit 0 is the high bit
+        int byte_index = (i % (SECTOR_SIZE * 8)) / 8;
+        unsigned char mask = (unsigned char) (128 >> (i % 8));
+        if (value) {
+            *(bitmap + byte_index) |= mask;
+        } else {
+            *(bitmap + byte_index) &= ~mask;
+        }
+    }
+
+    if (bitmap != NULL) {
+        Journal_Note(bitmap_sec, 1);
+        Disk_Put(bitmap_sec, 1);                    // Write the change
+    }
+
+    if (alloc == &inode_alloc) {
+        value ? COUNT(inodes_allocated, changed) : COUNT(inodes_freed, changed);
+    } else {
+        value ? COUNT(blocks_allocated, changed) : COUNT(blocks_freed, changed);
+    }
+}
+
+/*
+ * Change_Bitmap_Range
+ *
+ * Set_Bits for a caller that doesn't hold any group locks.
+ */
+int
+Change_Bitmap_Range(Bitmap_Alloc *alloc, int offset, int count, int value)
+{
+    if (offset < 0 || count < 0 || offset + count > alloc->nbits) {
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
     }
 
+    Lock_Groups(alloc, offset, count);
+    Set_Bits(alloc, offset, count, value);
+    Unlock_Groups(alloc, offset, count);
     return 0;
 }
 
+/*
+ * Change_Bitmap_Value
+ *
+ * Sets (value 1) or clears (value 0) the bit for offset in the bitmap of
+ * alloc.
+ */
 int
-File_Create(char *file)
+Change_Bitmap_Value(Bitmap_Alloc *alloc, int offset, int value)
 {
-    printf("FS_Create\n");
-    char *token, *path;
-    int i, inode_to_search = 0;
-    int num_tokens = Get_Path_Token_Count(file);
-
-    if (Find_Pathname_Errors(file) == -1) {
-        osErrno = E_CREATE;
-        return -1;
-    }
+    return Change_Bitmap_Range(alloc, offset, 1, value);
+}
 
-    path = malloc(strlen(file) + 1);
-    strcpy(path, file);
+/*
+ * Free_List_Add
+ *
+ * Adds bit to list.  Should the list not grow, the bit is cleared on its
+ * own right away instead.
+ */
+void
+Free_List_Add(Free_List *list, int bit)
+{
+    int *bits;
 
-    token = strtok(path, "/");
+    if (list->count == list->max) {
+        if ((bits = realloc(list->bits, (list->max ? 2 * list->max : 256) * sizeof(int))) == NULL) {
+            Change_Bitmap_Value(list->alloc, bit, 0);
+            return;
+        }
+        list->bits = bits;
+        list->max = list->max ? 2 * list->max : 256;
+    }
+    list->bits[list->count++] = bit;
+}
 
-    for (i = 0; i < num_tokens; i++) {
-        if (i == num_tokens - 1) {      // If we are looking at the last token
+/*
+ * Free_List_Flush
+ *
+ * Clears the bits of list, in order, so each bitmap sector is pinned and
+ * written (and journaled) once: as many as the journal piece has room
+ * for, the rest stay on the list.  The groups from the first bit's to the
+ * last one's are locked for the while.  An emptied list is freed.
+ */
+void
+Free_List_Flush(Free_List *list)
+{
+    Bitmap_Alloc *alloc = list->alloc;
+    int sec = alloc->start * SECTORS_PER_BLOCK;
+    int i, n, bit, first, span, left = Journal_Left(), bitmap_sec = -1, changed = 0;
+    char *bitmap = NULL;
 
-            if ((Is_In_Directory(inode_to_search, token)) == 0) {
-                osErrno = E_CREATE;
-                printf("File_Create failed.  Filename %s already exists.\n", token);
-                return -1;
+    if (list->count > 0) {
+        qsort(list->bits, list->count, sizeof(int), Compare_Bit);
+        for (n = 0; n < list->count; n++) {
+            if (list->bits[n] / (SECTOR_SIZE * 8) != bitmap_sec) {
+                if (left-- == 0) {
+                    break;
+                }
+                bitmap_sec = list->bits[n] / (SECTOR_SIZE * 8);
             }
+        }
+        if (n == 0) {
+            return;
+        }
+        bitmap_sec = -1;
+        first = list->bits[0];
+        span = list->bits[n - 1] - first + 1;
 
-            Insert_Log(inode_to_search, token, NORM_FILE);     // osErrno is set inside this function and -1 is returned
+        Lock_Groups(alloc, first, span);
+        for (i = 0; i < n; i++) {
+            bit = list->bits[i];
+            if (!(alloc->words[bit / 64] & ((uint64_t) 1 << (bit % 64)))) {
+                continue;                           // already free
+            }
+            alloc->words[bit / 64] &= ~((uint64_t) 1 << (bit % 64));
+            alloc->groups[bit / alloc->group_bits].free_count++;
+            changed++;
 
-        } else {
-            inode_to_search = Find_Inode(inode_to_search, token);
-            printf("\tThe inode to search value is: %d\n", inode_to_search);
-            if (inode_to_search != -1) {
-                token = strtok(NULL, "/");
-                printf("The new token is: %s\n", token);
+            if (sec + bit / (SECTOR_SIZE * 8) != bitmap_sec) {
+                if (bitmap != NULL) {
+                    Journal_Note(bitmap_sec, 1);
+                    Disk_Put(bitmap_sec, 1);
+                }
+                bitmap_sec = sec + bit / (SECTOR_SIZE * 8);
+                bitmap = Disk_Get(bitmap_sec);
             }
+            bitmap[(bit % (SECTOR_SIZE * 8)) / 8] &= ~(unsigned char) (128 >> (bit % 8));
         }
+        if (bitmap != NULL) {
+            Journal_Note(bitmap_sec, 1);
+            Disk_Put(bitmap_sec, 1);
+        }
+        Unlock_Groups(alloc, first, span);
+
+        (alloc == &inode_alloc) ? COUNT(inodes_freed, changed) : COUNT(blocks_freed, changed);
+        list->count -= n;
+        memmove(list->bits, list->bits + n, list->count * sizeof(int));
     }
 
-    free(path);
-    return 0;
+    if (list->count == 0) {
+        free(list->bits);
+        list->bits = NULL;
+        list->max = 0;
+    }
 }
 
-int
-Find_Inode(int inode_number, char *token){
-    char inodeBuf[SECTOR_SIZE];   // our buffer for this function's inode block read
-    char dataBuf[SECTOR_SIZE];      // our buffer for this functions data block read
-    int sec = INODE_SEC_START + (inode_number / 4); // determine the block to read for this inode value
-    int offset = (inode_number % 4) * 128;  // determine the offset for this inode within the sector
-    Inode *inode;
-    Dir_Data_Block *data;
-    Disk_Read(sec, inodeBuf);     // read in the sector from disk
-    inode = (Inode *) (inodeBuf + offset);
-
-    int i;
-    for (i = 0; i < MAX_INODE_BLOCKS; i++) {
-        if (inode->blocks[i] != -1) {
-            Disk_Read(DATA_SEC_START + inode->blocks[i], dataBuf);
-            data = (Dir_Data_Block *) dataBuf;
-            int j;
-            for(j = 0; j < sizeof(Log); j++) {
-                if (strcmp(token, data->logs[j].name) == 0) {
-                    return data->logs[j].inode_number;
-                }
-            }
+/*
+ * Free_List_Finish
+ *
+ * Frees what is on blocks and then what is on inodes, going on in new
+ * journal pieces for as long as it takes (see Journal_Piece).  The caller
+ * holds no locks but journal_lock and nothing can reach these any more:
+ * a crash part way only leaves the rest marked in use.
+ */
+void
+Free_List_Finish(Free_List *blocks, Free_List *inodes)
+{
+    for (;;) {
+        Free_List_Flush(blocks);
+        if (blocks->count == 0) {
+            Free_List_Flush(inodes);
         }
+        if (blocks->count == 0 && inodes->count == 0) {
+            return;
+        }
+        Journal_Piece();
     }
-
-    return -1;
 }
 
 int
-//Insert_Log(Inode *parent, char *token) {        // todo:  throw function calls into if statements for error checking
-Insert_Log(int parent_inode_num, char *token, int file_type) {
-    Inode *parent;
-    char dir_buffer[SECTOR_SIZE];
-
-    int j, i, data_block = NULL, inode_num;
-    char read_buffer[SECTOR_SIZE];
-    Log log;
+Compare_Bit(const void *a, const void *b)
+{
+    int x = *(const int *) a, y = *(const int *) b;
 
-    inode_num = Create_Inode(file_type);
-    log.inode_number = inode_num;
-    printf("DEBUG: New file inode number is: %d\n", log.inode_number);
-    strcpy(log.name, token);
+    return (x > y) - (x < y);
+}
 
-    int sec = INODE_SEC_START + (parent_inode_num / 4);
-    int offset = parent_inode_num % 4;
-    Disk_Read(sec, dir_buffer);
-    parent = (Inode *) (dir_buffer + (offset * sizeof(Inode)));
+/*
+ * Inode_Group
+ *
+ * Which inode allocation group a new inode under parent should come from.
+ * Files stay in their parent's group, so a directory's inodes and (see
+ * Data_Group) their blocks end up near each other on disk.  New
+ * directories start new neighbourhoods: each one goes to the next group in
+ * turn that has at least the average number of both free inodes and free
+ * data blocks, so separate directory trees (and the threads working in
+ * them) spread out over the groups without piling into full ones.
+ */
+int
+Inode_Group(int parent, int type)
+{
+    static int next_dir_group = 0;
+    long free_inodes = 0, free_blocks = 0;
+    int i, g, start;
 
-    if (parent->size > 14980) {
-        osErrno = E_NO_SPACE;
-        printf("File_Create failed, not enough space in directory.\n");
-        return -1;
+    if (type != DIR_FILE) {
+        return parent / inode_alloc.group_bits;
     }
 
-
-    for(j = 0; j < MAX_INODE_BLOCKS; j++) {
-        if (parent->blocks[j] == -1) {  // if there is no data block associated with this inode block pointer
-            data_block = Find_Free_Data_Block();
-            Change_Bitmap_Value(data_block, DATA_BITMAP_SEC);
-            printf("DEBUG: This file's log is stored on data block: %d\n", data_block);
-            Dir_Data_Block dir_block = New_Dir_Data_Block();
-            parent->blocks[j] = data_block;
-            parent->size += sizeof(Log);
-            dir_block.logs[0] = log;
-            Disk_Read(DATA_SEC_START + data_block, read_buffer);
-            memcpy(read_buffer, &dir_block, sizeof(Dir_Data_Block));
-            Disk_Write(DATA_SEC_START + data_block, read_buffer);
-            Disk_Write(sec, dir_buffer);
-//            Debug_Testing();
-            return data_block;
-
-        } else {
-            printf("DEBUG: Searching data block %d\n", parent->blocks[j]);
-            Disk_Read(DATA_SEC_START + parent->blocks[j], read_buffer);
-            Dir_Data_Block *dir_block = (Dir_Data_Block *) read_buffer;
-
-            for (i = 0; i < 25; i++) {
-                int foo = dir_block->logs[i].inode_number;
-                printf("DEBUG: Inode at log# %d   is: %d\n", i, dir_block->logs[i].inode_number);
-
-                if (dir_block->logs[i].inode_number == -1) {
-                    dir_block->logs[i] = log;
-                    parent->size += sizeof(Log);
-                    printf("DEBUG: Writing to log index %d\n", i);
-                    memcpy(read_buffer, dir_block, sizeof(Dir_Data_Block));
-                    Disk_Write(DATA_SEC_START + parent->blocks[j], read_buffer);
-                    Disk_Write(sec, dir_buffer);
-                    return 0;
-                }
-            }
+    start = __atomic_fetch_add(&next_dir_group, 1, __ATOMIC_RELAXED) % inode_alloc.ngroups;
+    if (sb.num_groups == 1) {
+        return start;                               // one group on disk, just spread the locks
+    }
+    for (g = 0; g < inode_alloc.ngroups; g++) {
+        free_inodes += Group_Free(&inode_alloc, g);
+        free_blocks += Group_Free(&data_alloc, g);
+    }
+    for (i = 0; i < inode_alloc.ngroups; i++) {
+        g = (start + i) % inode_alloc.ngroups;
+        if ((long) Group_Free(&inode_alloc, g) * inode_alloc.ngroups >= free_inodes &&
+            (long) Group_Free(&data_alloc, g) * data_alloc.ngroups >= free_blocks) {
+            return g;
         }
     }
-
-    return -1;
+    return start;
 }
 
-Dir_Data_Block
-New_Dir_Data_Block()
+/*
+ * Group_Free
+ *
+ * Free bits in allocation group g, a snapshot.
+ */
+int
+Group_Free(Bitmap_Alloc *alloc, int g)
 {
-    int i;
-    Dir_Data_Block block;
-    for (i = 0; i < SECTOR_SIZE / sizeof(Log); i++) {
-        block.logs[i].inode_number = -1;
-    }
+    int n;
 
-    return block;
+    pthread_mutex_lock(&alloc->groups[g].lock);
+    n = alloc->groups[g].free_count;
+    pthread_mutex_unlock(&alloc->groups[g].lock);
+    return n;
 }
 
+/*
+ * Data_Group
+ *
+ * The data allocation group that goes with an inode's group, for its
+ * blocks.  With groups on disk it is the same group, right after the
+ * inode's slice of the table.
+ */
 int
-Is_In_Directory(int parent_inode_number, char *token)
+Data_Group(int inode_number)
 {
-    int i, sec;
-    size_t offset;
-    sec = INODE_SEC_START + (parent_inode_number / 4);
-    offset = ((parent_inode_number % 4) * sizeof(Inode));
-    Inode *parent;
-    char Is_In_Directory_Buffer[SECTOR_SIZE];
-    Disk_Read(sec, Is_In_Directory_Buffer);
-    parent = (Inode *) (Is_In_Directory_Buffer + offset);
-
-    for(i = 0; i < MAX_INODE_BLOCKS; i++) {
-        if (parent->blocks[i] != -1) {
-            int data_block = parent->blocks[i];
-            char Data_Block_Buffer[SECTOR_SIZE];
-            Disk_Read(DATA_SEC_START + data_block, Data_Block_Buffer);
-            Dir_Data_Block *dir_block = (Dir_Data_Block *) Data_Block_Buffer;
-            int j;
-            for (j = 0; j < 25; j++) {
-                if ((strcmp(token, dir_block->logs[j].name)) == 0) {
-                    return 0;
-                }
-            }
+    return (inode_number / inode_alloc.group_bits) * data_alloc.ngroups / inode_alloc.ngroups;
+}
+
+/*
+ * Free_Run_Length
+ *
+ * How many free blocks follow bit (inclusive), up to max.  Runs stop at the
+ * end of bit's allocation group, whose lock the caller holds.
+ */
+int
+Free_Run_Length(Bitmap_Alloc *alloc, int bit, int max)
+{
+    Alloc_Group *group = &alloc->groups[bit / alloc->group_bits];
+    int end = group->first + group->nbits;
+    int len = 0;
+
+    if (max > end - bit) {
+        max = end - bit;
+    }
+    while (len < max) {
+        uint64_t used = alloc->words[bit / 64] >> (bit % 64);
+        int left_in_word = 64 - (bit % 64);
+        int run = (used == 0) ? left_in_word : __builtin_ctzll(used);
+
+        len += run;
+        bit += run;
+        if (run < left_in_word) {
+            break;
         }
     }
 
-    return -1;  // the file does not exist in the directory
+    return (len < max) ? len : max;
 }
 
+/*
+ * Find_Free_Extent
+ *
+ * Looks for want contiguous free blocks in group g, next fit from the
+ * group's cursor.  If no run is that long, settles for the longest one.  The
+ * length found is put in *length; returns the first block, or -1 if the
+ * group is full.  Like Find_Free_Bit nothing is claimed, and the caller
+ * holds the group's lock.
+ */
 int
-Find_Pathname_Errors(char *file)
+Find_Free_Extent(Bitmap_Alloc *alloc, int g, int want, int *length)
 {
-    char *token, *path;
-
-    // Save the file name into a mutable string
-    path = malloc(strlen(file) + 1);
-    strcpy(path, file);
+    Alloc_Group *group = &alloc->groups[g];
+    int first = group->first / 64;
+    int nwords = (group->nbits + 63) / 64;
+    int i, w, bit, run, best = -1, best_len = 0;
 
-    if ((token = strtok(path, "/")) == NULL) {
-        printf("Create failed.  File/Dir name cannot be null.\n");
+    COUNT(alloc_searches, 1);
+    *length = 0;
+    if (group->free_count == 0 || want <= 0) {
         return -1;
     }
 
-    do {
-        // Check if the token name is too big per guidelines
-        if (strlen(token) > MAX_FILE_SIZE) {
-            printf("Create failed. File/Dir name %s is too long.\n", token);
-            return -1;
-        }
-
-        token = strtok(NULL, "/");
+    for (i = 0; i < nwords; i++) {
+        w = first + (group->cursor - first + i) % nwords;
 
-    } while (token != NULL);
+        // every free run in this word (a run may carry on into the next ones)
+        uint64_t free_bits = ~alloc->words[w];
+        while (free_bits != 0) {
+            bit = w * 64 + __builtin_ctzll(free_bits);
+            run = Free_Run_Length(alloc, bit, want);
+            if (run == want) {
+                group->cursor = w;
+                *length = run;
+                return bit;
+            }
+            if (run > best_len) {
+                best = bit;
+                best_len = run;
+            }
+            if ((bit % 64) + run >= 64) {
+                break;
+            }
+            free_bits &= ~(uint64_t) 0 << ((bit % 64) + run);
+        }
+    }
 
-    free(path);
-    return 0;
+    *length = best_len;
+    return best;
 }
 
+/*
+ * Inode_Block_Count
+ *
+ * Number of data blocks mapped by an inode.
+ */
 int
-Get_Path_Token_Count(char *file)
+Inode_Block_Count(Inode *inode)
 {
-    int count = 0;
-    // Save the file name into a mutable string
-    char *pathname = malloc(strlen(file) + 1);
-    strcpy(pathname, file);
-
-    strtok(pathname, "/");
-    do { count++; } while (strtok(NULL, "/") != NULL);
+    int i, mid, count = 0, end;
 
-    free(pathname);
+    if (inode->type & INODE_INLINE) {
+        return 0;
+    }
+    if (inode->type & INODE_EXTENTS) {
+        for (i = 0; i < MAX_INODE_EXTENTS && inode->extents[i].start != -1; i++) {
+            count += inode->extents[i].length;
+        }
+    } else {
+        // block mapped inodes are filled in order, so the first hole is the
+        // count, found by halving (a big file maps a lot of blocks)
+        end = Inode_Max_Blocks(inode);
+        while (count < end) {
+            mid = count + (end - count) / 2;
+            if (Inode_Map_Block(-1, inode, mid) != -1) {
+                count = mid + 1;
+            } else {
+                end = mid;
+            }
+        }
+    }
     return count;
 }
 
-int
-File_Open(char *file)
+/*
+ * Gather_Blocks, Gather_Pointers
+ *
+ * Adds every data block an inode holds to list: its extents, or its
+ * direct blocks and whatever the indirect and double indirect blocks
+ * point to, pointer blocks included.  Inline files hold none.
+ */
+void
+Gather_Blocks(int inode_number, Free_List *list)
 {
-    printf("FS_Open\n");
-    return 0;
-}
+    Inode *inode = Pin_Inode(inode_number);
+    int i, b, direct, *ptrs;
 
-int
-File_Read(int fd, void *buffer, int size)
-{
-    printf("FS_Read\n");
-    return 0;
+    if (inode->type & INODE_INLINE) {
+        // nothing outside the inode
+    } else if (inode->type & INODE_EXTENTS) {
+        for (i = 0; i < MAX_INODE_EXTENTS && inode->extents[i].start != -1; i++) {
+            for (b = 0; b < inode->extents[i].length; b++) {
+                Free_List_Add(list, inode->extents[i].start + b);
+            }
+        }
+    } else {
+        direct = (inode->type & INODE_INDIRECT) ? NUM_DIRECT_BLOCKS : MAX_INODE_BLOCKS;
+        for (i = 0; i < direct; i++) {
+            if (inode->blocks[i] != -1) {
+                Free_List_Add(list, inode->blocks[i]);
+            }
+        }
+        if ((inode->type & INODE_INDIRECT) && inode->blocks[INDIRECT_SLOT] != -1) {
+            Gather_Pointers(inode->blocks[INDIRECT_SLOT], list);
+        }
+        if ((inode->type & INODE_INDIRECT) && inode->blocks[DINDIRECT_SLOT] != -1) {
+            ptrs = (int *) Get_Block(DATA_BLOCK(inode->blocks[DINDIRECT_SLOT]));
+            for (i = 0; i < PTRS_PER_BLOCK; i++) {
+                if (ptrs[i] != -1) {
+                    Gather_Pointers(ptrs[i], list);
+                }
+            }
+            Put_Block(DATA_BLOCK(inode->blocks[DINDIRECT_SLOT]), 0);
+            Free_List_Add(list, inode->blocks[DINDIRECT_SLOT]);
+        }
+
+        // whatever reuses the inode number mustn't find these mappings
+        if ((inode->type & INODE_INDIRECT) && inode->blocks[INDIRECT_SLOT] != -1) {
+            Drop_Bmap(inode_number);
+        }
+    }
+    Unpin_Inode(inode_number, 0);
 }
 
-int
-File_Write(int fd, void *buffer, int size)
+void
+Gather_Pointers(int ptr_block, Free_List *list)
 {
-    printf("FS_Write\n");
-    return 0;
+    int *ptrs = (int *) Get_Block(DATA_BLOCK(ptr_block));
+    int i;
+
+    for (i = 0; i < PTRS_PER_BLOCK; i++) {
+        if (ptrs[i] != -1) {
+            Free_List_Add(list, ptrs[i]);
+        }
+    }
+    Put_Block(DATA_BLOCK(ptr_block), 0);
+    Free_List_Add(list, ptr_block);
 }
 
+/*
+ * Inode_Max_Blocks
+ *
+ * How many blocks a block mapped inode can point to.
+ */
 int
-File_Seek(int fd, int offset)
+Inode_Max_Blocks(Inode *inode)
 {
-    printf("FS_Seek\n");
-    return 0;
+    if (inode->type & INODE_INDIRECT) {
+        return NUM_DIRECT_BLOCKS + PTRS_PER_BLOCK + PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+    }
+    return MAX_INODE_BLOCKS;
 }
 
+/*
+ * Read_Pointer
+ *
+ * Entry index of the pointer block ptr_block, or -1 if there is no such block.
+ */
 int
-File_Close(int fd)
+Read_Pointer(int ptr_block, int index)
 {
-    printf("FS_Close\n");
-    return 0;
+    int block;
+
+    if (ptr_block == -1) {
+        return -1;
+    }
+    block = ((int *) Get_Block(DATA_BLOCK(ptr_block)))[index];
+    Put_Block(DATA_BLOCK(ptr_block), 0);
+    return block;
 }
 
+/*
+ * Inode_Map_Block
+ *
+ * Maps block index of a block mapped inode (a directory, or a file whose
+ * extents ran out) to its data block.
+ * With INODE_INDIRECT the first NUM_DIRECT_BLOCKS come straight from
+ * blocks[], the next PTRS_PER_BLOCK through the indirect block and the rest
+ * through the double indirect block; older inodes use all of blocks[] as
+ * direct blocks.  Anything past the direct blocks is remembered in the bmap
+ * cache (pass inode_number -1 to skip it), so walking a big directory again
+ * doesn't chase the same pointer blocks.  Returns -1 for a hole.
+ */
 int
-File_Unlink(char *file)
+Inode_Map_Block(int inode_number, Inode *inode, int index)
 {
-    printf("FS_Unlink\n");
-
-    // CHECK THE OPEN FILE TABLE FOR THIS FILE
-
-    char *token, *path;
-    int i, inode_to_search = 0;
-    int num_tokens = Get_Path_Token_Count(file);
+    Bmap_Entry *entry = NULL;
+    int block, i;
 
-    if (Find_Pathname_Errors(file) == -1) {
-        osErrno = E_CREATE;
+    if (index < 0 || index >= Inode_Max_Blocks(inode)) {
         return -1;
     }
+    if (!(inode->type & INODE_INDIRECT) || index < NUM_DIRECT_BLOCKS) {
+        return inode->blocks[index];
+    }
 
-    path = malloc(strlen(file) + 1);
-    strcpy(path, file);
+    if (inode_number != -1) {
+        entry = &bmap_cache[(unsigned) (inode_number * PTRS_PER_BLOCK + index) % BMAP_CACHE_SIZE];
+        pthread_mutex_lock(&bmap_lock);
+        if (entry->inode_number == inode_number && entry->index == index) {
+            block = entry->block;
+            pthread_mutex_unlock(&bmap_lock);
+            return block;
+        }
+        pthread_mutex_unlock(&bmap_lock);
+    }
 
-    token = strtok(path, "/");
+    i = index - NUM_DIRECT_BLOCKS;
+    if (i < PTRS_PER_BLOCK) {
+        block = Read_Pointer(inode->blocks[INDIRECT_SLOT], i);
+    } else {
+        i -= PTRS_PER_BLOCK;
+        block = Read_Pointer(Read_Pointer(inode->blocks[DINDIRECT_SLOT], i / PTRS_PER_BLOCK),
+                             i % PTRS_PER_BLOCK);
+    }
 
-    for (i = 0; i < num_tokens; i++) {
-        if (i == num_tokens - 1) {      // If we are looking at the last token
-            if (Is_In_Directory(inode_to_search, token) == -1) {
-                osErrno = E_NO_SUCH_FILE;
-                printf("File_Unlink failed, no such file: %s.\n", token);
-                return -1;
-            }
+    // only real blocks are cached, holes get filled in later
+    if (entry != NULL && block != -1) {
+        pthread_mutex_lock(&bmap_lock);
+        entry->inode_number = inode_number;
+        entry->index = index;
+        entry->block = block;
+        pthread_mutex_unlock(&bmap_lock);
+    }
+    return block;
+}
 
-            Unlink_File_Log(inode_to_search, token);
+/*
+ * New_Pointer_Block
+ *
+ * Allocates a data block to hold block pointers, all -1 to begin with,
+ * preferably from data allocation group group.
+ */
+int
+New_Pointer_Block(int group)
+{
+    int block;
+    char *data;
 
-        } else {
-            inode_to_search = Find_Inode(inode_to_search, token);
-            if (inode_to_search != -1) {
-                token = strtok(NULL, "/");
-                Find_Inode(inode_to_search, token);
-            } else {
-                // The file does not exist
-                osErrno = E_NO_SUCH_FILE;
-                printf("File_Unlink failed, no such directory: %s.\n", token);
-                return -1;
-            }
-        }
+    if ((block = Alloc_Bit(&data_alloc, group)) == -1) {
+        return -1;
     }
 
-    free(path);
-    return 0;
+    data = Get_Block(DATA_BLOCK(block));
+    memset(data, 0xff, BLOCK_SIZE);
+    Put_Block(DATA_BLOCK(block), 1);
+    return block;
 }
 
+/*
+ * Set_Pointer
+ *
+ * Stores block in entry index of the pointer block in *slot, allocating the
+ * pointer block first (from data allocation group group) if *slot is -1.
+ */
 int
-Unlink_File_Log(int inode_to_search, char *token)
+Set_Pointer(int *slot, int index, int block, int group)
 {
-    int sec, i, offset, block = 0;
-    Dir_Data_Block *data_block;
-    Inode *parent;
-    char Unlink_Log_Buffer[SECTOR_SIZE];
-    char Unlink_Data_Buffer[SECTOR_SIZE];
+    int *ptrs;
 
-    sec = INODE_SEC_START + (inode_to_search / 4);
-    offset = (inode_to_search % 4) * 128;
-    Disk_Read(sec, Unlink_Log_Buffer);
-    parent = (Inode *) (Unlink_Log_Buffer + offset);
-
-    for (i = 0; i < MAX_INODE_BLOCKS; i++) {
-        if (parent->blocks[i] != -1) {
-
-            block = parent->blocks[i];
-            Disk_Read(DATA_SEC_START + block, Unlink_Data_Buffer);
-            data_block = (Dir_Data_Block *) Unlink_Data_Buffer;
-            int j;
-            for (j = 0; j < 25; j++) {
-                // Mark the Log as free in the data sector
-                if ((strcmp(token, data_block->logs[j].name)) == 0) {
-                    int k;
-                    for (k = 0; k < 16; k++) {
-                        data_block->logs[j].name[k] = '-';
-                    }
-                    int free_this_inode = data_block->logs[j].inode_number;
-                    data_block->logs[j].inode_number = -1;
-                    Change_Bitmap_Value(free_this_inode, INODE_BITMAP_SEC);    // Mark the file's inode as unallocated
-                    parent->size -= sizeof(Log);                               // Decrease the size of the parent directory
-                    Disk_Write(sec, Unlink_Log_Buffer);
-                    Disk_Write(DATA_SEC_START + block, Unlink_Data_Buffer);
-                    return 0;
-                }
-            }
-        }
+    if (*slot == -1 && (*slot = New_Pointer_Block(group)) == -1) {
+        return -1;
     }
-
+    ptrs = (int *) Get_Block(DATA_BLOCK(*slot));
+    ptrs[index] = block;
+    Dirty_Range(DATA_BLOCK(*slot), index * sizeof(int), sizeof(int));
+    Put_Block(DATA_BLOCK(*slot), 0);
     return 0;
 }
 
-// directory ops
+/*
+ * Inode_Add_Block
+ *
+ * Points block index of a block mapped inode at data block block, growing
+ * the indirect and double indirect blocks as needed.  The caller writes the
+ * inode back.
+ */
 int
-Dir_Create(char *file)
+Inode_Add_Block(int inode_number, Inode *inode, int index, int block)
 {
-    printf("Dir_Create %s\n", file);
-    char *token, *path;
-    int i, inode_to_search = 0;
-    int num_tokens = Get_Path_Token_Count(file);
+    int mid, i = index;
+    int group = (inode_number == -1) ? 0 : Data_Group(inode_number);
 
-    if (Find_Pathname_Errors(file) == -1) {
-        osErrno = E_CREATE;
+    if (index < 0 || index >= Inode_Max_Blocks(inode)) {
+        osErrno = E_FILE_TOO_BIG;
         return -1;
     }
+    if (!(inode->type & INODE_INDIRECT) || index < NUM_DIRECT_BLOCKS) {
+        inode->blocks[index] = block;
+        return 0;
+    }
 
-    path = malloc(strlen(file) + 1);
-    strcpy(path, file);
-
-    token = strtok(path, "/");
-
-    for (i = 0; i < num_tokens; i++) {
-        if (i == num_tokens - 1) {      // If we are looking at the last token
-
-            if ((Is_In_Directory(inode_to_search, token)) == 0) {
-                osErrno = E_CREATE;
-                printf("File_Create failed.  Filename %s already exists.\n", token);
+    i -= NUM_DIRECT_BLOCKS;
+    if (i < PTRS_PER_BLOCK) {
+        if (Set_Pointer(&inode->blocks[INDIRECT_SLOT], i, block, group) == -1) {
+            osErrno = E_NO_SPACE;
+            return -1;
+        }
+    } else {
+        i -= PTRS_PER_BLOCK;
+        if ((mid = Read_Pointer(inode->blocks[DINDIRECT_SLOT], i / PTRS_PER_BLOCK)) == -1) {
+            if ((mid = New_Pointer_Block(group)) == -1) {
+                osErrno = E_NO_SPACE;
                 return -1;
             }
-
-            Insert_Log(inode_to_search, token, DIR_FILE);     // osErrno is set inside this function and -1 is returned
-
-        } else {
-            inode_to_search = Find_Inode(inode_to_search, token);
-            if (inode_to_search != -1) {
-                token = strtok(NULL, "/");
+            if (Set_Pointer(&inode->blocks[DINDIRECT_SLOT], i / PTRS_PER_BLOCK, mid, group) == -1) {
+                Change_Bitmap_Value(&data_alloc, mid, 0);           // nothing points at it
+                osErrno = E_NO_SPACE;
+                return -1;
             }
         }
+        if (Set_Pointer(&mid, i % PTRS_PER_BLOCK, block, group) == -1) {
+            osErrno = E_NO_SPACE;
+            return -1;
+        }
     }
 
-    free(path);
-    return 0;
-}
-
-int
-Dir_Size(char *path)
-{
-    printf("Dir_Size\n");
+    if (inode_number != -1) {
+        Bmap_Entry *entry = &bmap_cache[(unsigned) (inode_number * PTRS_PER_BLOCK + index) % BMAP_CACHE_SIZE];
+        pthread_mutex_lock(&bmap_lock);
+        entry->inode_number = inode_number;
+        entry->index = index;
+        entry->block = block;
+        pthread_mutex_unlock(&bmap_lock);
+    }
     return 0;
 }
 
-int
-Dir_Read(char *path, void *buffer, int size)
+/*
+ * Drop_Bmap
+ *
+ * Forgets every cached block mapping of an inode (when it goes away).
+ */
+void
+Drop_Bmap(int inode_number)
 {
-    printf("Dir_Read\n");
-    return 0;
-}
+    int i;
 
-int
-Dir_Unlink(char *path)
-{
-    printf("Dir_Unlink\n");
-    return 0;
+    pthread_mutex_lock(&bmap_lock);
+    for (i = 0; i < BMAP_CACHE_SIZE; i++) {
+        if (bmap_cache[i].inode_number == inode_number) {
+            bmap_cache[i].inode_number = -1;
+        }
+    }
+    pthread_mutex_unlock(&bmap_lock);
 }
 
+/*
+ * Inode_Run
+ *
+ * Maps block index of a file to its data block, and puts in *count how many
+ * blocks from there on are contiguous on disk (so they can be moved with one
+ * multi-sector copy).  A block mapped file is only looked at for the want
+ * blocks the caller is after.  Returns -1 past the end of the file.
+ */
 int
-Create_Inode(int type)
+Inode_Run(Inode *inode, int index, int want, int *count)
 {
-    int offset, sec, start_pos, i;
+    int i;
 
-    // Determine the inode offset value (from index 0 in the inode bitmap)
-    if ((offset = Find_Free_Inode_Block()) == -1)
-    {
-        osErrno = E_NO_SPACE;
-        printf("Create_Inode() failed, disk space full.\n");
+    *count = 0;
+    if (index < 0) {
         return -1;
-    } else {
-        printf("DEBUG: This inode's bitmap location is: %d\n", (unsigned) offset);
     }
 
-    // Create and initialize the inode
-    Inode node;                                     //  TODO: throw this into a New_Inode() function
-    node.size = 0;
-    node.type = type;
-    for (i = 0; i < MAX_INODE_BLOCKS; i++) {
-        node.blocks[i] = -1;
+    if (!(inode->type & INODE_EXTENTS)) {
+        int block = Inode_Map_Block(-1, inode, index);
+        if (block != -1) {
+            for (*count = 1; *count < want && Inode_Map_Block(-1, inode, index + *count) == block + *count; (*count)++)
+                ;
+        }
+        return block;
     }
 
-    // Determine the sector and position of the free inode    TODO: get rid of magic numbers
-    sec = INODE_SEC_START + (offset / 4);                     // 4 inodes per sector
-    start_pos = (offset % 4) * (int) sizeof(Inode);           // Find where in the sector the free inode info starts
-    Disk_Read(sec, buf);                                      // Read the free inode sector
+    for (i = 0; i < MAX_INODE_EXTENTS && inode->extents[i].start != -1; i++) {
+        if (index < inode->extents[i].length) {
+            *count = inode->extents[i].length - index;
+            return inode->extents[i].start + index;
+        }
+        index -= inode->extents[i].length;
+    }
+    return -1;
+}
 
-    printf("DEBUG: This inode's sector is: %d, and its offset is: %d\n", sec, start_pos);
+/*
+ * Inode_Reserve
+ *
+ * Grows a file's inode until it maps at least nblocks data blocks.
+ * The last extent is stretched in place when the blocks right after it are
+ * free, otherwise the rest is taken in as few new extents as the free space
+ * allows, starting in the inode's own data allocation group.  Free space
+ * too broken up for the extent slots turns the inode block mapped (see
+ * Extents_To_Blocks), so a file can still grow as far as a directory can.
+ * It stops short, returning 0, once the journal piece has no room for
+ * more.  Sets osErrno and returns -1 if the disk runs out; blocks claimed
+ * up to then stay with the inode.
+ */
+int
+Inode_Reserve(int inode_number, Inode *inode, int nblocks)
+{
+    int i, g, start, length, need, count, group = Data_Group(inode_number);
+    Alloc_Group *locked;
 
-    // Put the inode into the buffer
-    if (memcpy(buf + start_pos, &node, sizeof(Inode)) == NULL) {
-        printf("Error copying inode to buffer.  Create failed.\n");
-        return -1;
+    need = nblocks - Inode_Block_Count(inode);
+    if (!(inode->type & INODE_EXTENTS)) {
+        return Reserve_Blocks(inode_number, inode, nblocks - need, need);
     }
 
-    // Write the buffer to disk
-    Disk_Write(sec, buf);
+    for (i = 0; i < MAX_INODE_EXTENTS && inode->extents[i].start != -1; i++)
+        ;
 
-    // Mark inode allocated in the bitmap
-    Change_Bitmap_Value(offset, INODE_BITMAP_SEC);
-
-    return offset;
-}
+    // Try to just make the last run longer
+    if (need > 0 && i > 0) {
+        Extent *last = &inode->extents[i - 1];
+        int next = last->start + last->length;
+        if (next < data_alloc.nbits) {
+            locked = &data_alloc.groups[next / data_alloc.group_bits];
+            pthread_mutex_lock(&locked->lock);
+            if ((length = Journal_Bits(next, Free_Run_Length(&data_alloc, next, need), 0)) > 0) {
+                Set_Bits(&data_alloc, next, length, 1);
+                last->length += length;
+                need -= length;
+            }
+            pthread_mutex_unlock(&locked->lock);
+        }
+    }
 
-int
-Change_Bitmap_Value(int offset, int sec)
-{
-    sec += (offset / (SECTOR_SIZE * 8));        // Data block bitmap is sprawled along 3 sectors
-    offset %= SECTOR_SIZE * 8;                  // Offset redefined based on sector
+    for (g = 0; need > 0; ) {
+        if (i == MAX_INODE_EXTENTS) {
+            // the pointer blocks for all of it, and one block more
+            count = Inode_Block_Count(inode);
+            if (Journal_Left() - ADD_BLOCK_SECTORS <=
+                (count / PTRS_PER_BLOCK + 3) * (SECTORS_PER_BLOCK + 1) + count / (SECTOR_SIZE / (int) sizeof(int)) + 3) {
+                return 0;
+            }
+            if (Extents_To_Blocks(inode_number, inode) == -1) {
+                return -1;                          // osErrno set by Inode_Add_Block
+            }
+            return Reserve_Blocks(inode_number, inode, nblocks - need, need);
+        }
+        if (g == data_alloc.ngroups) {
+            osErrno = E_NO_SPACE;
+            return -1;
+        }
 
-    // Find which byte needs changed
-    int byte_index = offset / 8;                // 8 bits per byte
-    unsigned char add_val = (char) 128;         // We want to xor a bit within the byte at byte_index in the bitmap
-    add_val >>= (offset % 8);                   // This will shift the 1 in 10000000 to the appropriate position
+        locked = &data_alloc.groups[(group + g) % data_alloc.ngroups];
+        pthread_mutex_lock(&locked->lock);
+        if ((start = Find_Free_Extent(&data_alloc, (group + g) % data_alloc.ngroups, need, &length)) == -1) {
+            pthread_mutex_unlock(&locked->lock);
+            g++;                                    // this group is full, try the next
+            continue;
+        }
+        if ((length = Journal_Bits(start, length, 0)) == 0) {
+            pthread_mutex_unlock(&locked->lock);
+            return 0;
+        }
+        Set_Bits(&data_alloc, start, length, 1);
+        pthread_mutex_unlock(&locked->lock);
 
-    Disk_Read(sec, buf);
-    *(buf + byte_index) ^= add_val;
-    Disk_Write(sec, buf);                       // Write the change
+        inode->extents[i].start = start;
+        inode->extents[i].length = length;
+        need -= length;
+        i++;
+    }
 
     return 0;
 }
 
+/*
+ * Reserve_Blocks
+ *
+ * Inode_Reserve for a block mapped file: need more blocks from file block
+ * index on, still taken in runs as long as the free space has them (and
+ * the journal piece has room for them).
+ */
 int
-Find_Free_Inode_Block()
+Reserve_Blocks(int inode_number, Inode *inode, int index, int need)
 {
-    int i, j, offset = 0;
+    int b, g, start, length, group = Data_Group(inode_number);
+    Alloc_Group *locked;
 
-    // Read the inode bitmap from disk
-    Disk_Read(INODE_BITMAP_SEC, buf);
+    for (g = 0; need > 0; ) {
+        if (g == data_alloc.ngroups) {
+            osErrno = E_NO_SPACE;
+            return -1;
+        }
 
-    // find the first available inode
-    for (i = 0; i < NUM_INODE_BLOCKS; i++)
-    {
-        unsigned char current = (unsigned char) buf[i];
-        unsigned char op = (char) 128;
+        locked = &data_alloc.groups[(group + g) % data_alloc.ngroups];
+        pthread_mutex_lock(&locked->lock);
+        if ((start = Find_Free_Extent(&data_alloc, (group + g) % data_alloc.ngroups, need, &length)) == -1) {
+            pthread_mutex_unlock(&locked->lock);
+            g++;                                    // this group is full, try the next
+            continue;
+        }
+        if ((length = Journal_Bits(start, length, ADD_BLOCK_SECTORS)) == 0) {
+            pthread_mutex_unlock(&locked->lock);
+            return 0;
+        }
+        Set_Bits(&data_alloc, start, length, 1);
+        pthread_mutex_unlock(&locked->lock);
 
-        for (j = 0; j < 8; j++)
-        {
-            if ((current & op) == 0) { return offset; }
-            op >>= 1;
-            offset++;
+        for (b = 0; b < length; b++) {
+            if (Journal_Left() < ADD_BLOCK_SECTORS) {
+                Change_Bitmap_Range(&data_alloc, start + b, length - b, 0);
+                return 0;
+            }
+            if (Inode_Add_Block(inode_number, inode, index + b, start + b) == -1) {
+                Change_Bitmap_Range(&data_alloc, start + b, length - b, 0);
+                return -1;                          // osErrno set by Inode_Add_Block
+            }
         }
+        index += length;
+        need -= length;
     }
-
-    return -1;
+    return 0;
 }
 
-
+/*
+ * Extents_To_Blocks
+ *
+ * Turns a full extent mapped file into a block mapped one (with indirect
+ * blocks, like a directory) holding the same blocks in the same order.
+ * If the pointer blocks can't be had the inode is left as it was.
+ */
 int
-Find_Free_Data_Block()
+Extents_To_Blocks(int inode_number, Inode *inode)
 {
-    int i, j, offset = 0;
-    int sec = DATA_BITMAP_SEC;
+    Inode old = *inode;
+    int i, b, index = 0;
 
-    while (offset < NUM_DATA_BLOCKS) {
-        // Read the data block bitmap from disk
-        Disk_Read(sec, buf);
+    inode->type = INODE_TYPE(old.type) | INODE_INDIRECT;
+    for (i = 0; i < MAX_INODE_BLOCKS; i++) {
+        inode->blocks[i] = -1;
+    }
+    for (i = 0; i < MAX_INODE_EXTENTS && old.extents[i].start != -1; i++) {
+        for (b = 0; b < old.extents[i].length; b++) {
+            if (Inode_Add_Block(inode_number, inode, index++, old.extents[i].start + b) == -1) {
+                Free_Pointer_Blocks(inode);
+                Drop_Bmap(inode_number);
+                *inode = old;
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
 
-        // find the first available data block
-        for (i = 0; i < SECTOR_SIZE; i++) {
-            unsigned char current = (unsigned char) buf[i];
-            unsigned char op = (char) 128;
+/*
+ * Free_Pointer_Blocks
+ *
+ * Gives back the indirect, double indirect and middle blocks of a block
+ * mapped inode, but not the data blocks they point to.
+ */
+void
+Free_Pointer_Blocks(Inode *inode)
+{
+    int i, mid;
 
-            for (j = 0; j < 8; j++) {
-                if ((current & op) == 0) { return offset; }
-                op >>= 1;
-                offset++;
-                if (offset == NUM_DATA_BLOCKS) { return -1; }
+    if (inode->blocks[INDIRECT_SLOT] != -1) {
+        Change_Bitmap_Value(&data_alloc, inode->blocks[INDIRECT_SLOT], 0);
+    }
+    if (inode->blocks[DINDIRECT_SLOT] != -1) {
+        for (i = 0; i < PTRS_PER_BLOCK; i++) {
+            if ((mid = Read_Pointer(inode->blocks[DINDIRECT_SLOT], i)) != -1) {
+                Change_Bitmap_Value(&data_alloc, mid, 0);
             }
         }
-        sec++;
+        Change_Bitmap_Value(&data_alloc, inode->blocks[DINDIRECT_SLOT], 0);
     }
-
-    return -1;
 }
 
 void
@@ -693,7 +5623,7 @@ Pointer_Printing(char *token)
     size_t i;
     char thestring[16];
     strcpy(thestring, token);
-    printf("DEBUG: The word is: ");
+    DEBUG_PRINTF("DEBUG: The word is: ");
     for (i = 0; i < strlen(token); i++) {
         printf("%c", thestring[i]);
     }
@@ -9,8 +9,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 
-// used for errors
-extern int osErrno;
+// used for errors (each thread has its own)
+extern __thread int osErrno;
     
 // error types - don't change anything about these!! (even the order!)
 typedef enum {
@@ -30,7 +30,12 @@ typedef enum {
     
 // File system generic call
 int FS_Boot(char *path);
+int FS_Format(char *path, int block_size, int num_blocks, int num_inodes);
 int FS_Sync();
+int FS_SyncStart();
+int FS_SyncWait(int ticket);
+int FS_SyncPoll(int ticket);
+int FS_Commit();
 
 // file ops
 int File_Create(char *file);
@@ -41,11 +46,78 @@ int File_Seek(int fd, int offset);
 int File_Close(int fd);
 int File_Unlink(char *file);
 
+// bulk ops: count names in one directory at a time
+int File_CreateBatch(char *dir, char **names, int count);
+int File_UnlinkBatch(char *dir, char **names, int count);
+
 // directory ops
 int Dir_Create(char *path);
 int Dir_Size(char *path);
 int Dir_Read(char *path, void *buffer, int size);
 int Dir_Unlink(char *path);
+int Dir_UnlinkTree(char *path);     // Dir_Unlink for a directory and everything under it
+
+// directory listing a bufferful at a time
+int Dir_Open(char *path);
+int Dir_Next(int dd, void *buffer, int size);
+int Dir_Close(int dd);
+
+// one record of what Dir_Read and Dir_Next fill buffers with (packed, 20 bytes)
+typedef struct dir_entry {
+    char name[16];      // not terminated if it is 16 characters long
+    int inode_number;
+} Dir_Entry;
+
+// statistics, kept only by builds with FS_STATS defined (FS_GetStats
+// fails otherwise); sector counts live in Disk_Stats, split by FS_Region
+typedef enum {
+    FS_OP_BOOT,
+    FS_OP_FORMAT,
+    FS_OP_SYNC,
+    FS_OP_SYNC_START,
+    FS_OP_SYNC_WAIT,
+    FS_OP_COMMIT,
+    FS_OP_CREATE,
+    FS_OP_OPEN,
+    FS_OP_READ,
+    FS_OP_WRITE,
+    FS_OP_SEEK,
+    FS_OP_CLOSE,
+    FS_OP_UNLINK,
+    FS_OP_CREATE_BATCH,
+    FS_OP_UNLINK_BATCH,
+    FS_OP_DIR_CREATE,
+    FS_OP_DIR_SIZE,
+    FS_OP_DIR_READ,
+    FS_OP_DIR_UNLINK,
+    FS_OP_DIR_UNLINK_TREE,
+    FS_OP_DIR_OPEN,
+    FS_OP_DIR_NEXT,
+    FS_OP_DIR_CLOSE,
+    FS_OPS
+} FS_Op;
+
+typedef enum {
+    FS_REGION_SUPERBLOCK,
+    FS_REGION_BITMAPS,
+    FS_REGION_INODES,
+    FS_REGION_JOURNAL,
+    FS_REGION_DATA,
+    FS_REGIONS
+} FS_Region;
+
+typedef struct fs_stats {
+    long calls[FS_OPS];         // by FS_Op
+    long nanoseconds[FS_OPS];   // time spent in those calls, added up
+    long inodes_allocated;
+    long inodes_freed;
+    long blocks_allocated;
+    long blocks_freed;
+    long alloc_searches;        // allocation groups searched for free bits
+} FS_Stats;
+
+int FS_GetStats(FS_Stats *stats);
+void FS_ResetStats();
 
 typedef enum {
     INODE,
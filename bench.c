@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include "LibFS.h"
+#include "LibDisk.h"
+
+// Fixed workloads run against a freshly formatted and an aged image.  The
+// library's own chatter on stdout is thrown away; results go to stdout as
+// CSV, one line per (image, operation), so runs can be diffed.  With a disk
+// timing model ("hdd" or "ssd") each line also has the simulated disk time
+// of the run, which is what tells layouts apart.
+
+#define BENCH_BLOCK_SIZE    4096
+#define BENCH_NUM_BLOCKS    16384           // 64 MB
+#define BENCH_NUM_INODES    16384
+#define BENCH_FILES         2000            // default for create/lookup/unlink
+#define BENCH_BIG_BYTES     (8 * 1024 * 1024)
+#define BENCH_SEQ_CHUNK     (64 * 1024)
+#define BENCH_RAND_CHUNK    4096
+#define BENCH_RAND_OPS      2000
+#define BENCH_LIST_ROUNDS   50
+#define BENCH_SYNC_ROUNDS   20
+#define BENCH_BOOT_ROUNDS   10
+#define BENCH_AGE_ROUNDS    4
+
+FILE *results;
+char *image;
+int num_files = BENCH_FILES;
+double *samples;                            // latency of each op of the current run, in seconds
+int num_samples;
+int num_errors;                             // ops of the current run that failed
+long sim_start;                             // Disk_SimTime() when the run started
+char data[BENCH_SEQ_CHUNK];
+
+void
+usage(char *prog)
+{
+    fprintf(stderr, "usage: %s <disk image file> [files] [none|hdd|ssd]\n", prog);
+    exit(1);
+}
+
+double
+now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Start, Sample, Report
+ *
+ * Start begins an operation's run, Sample records one op's latency (and
+ * whether it worked) and Report prints the line for the run: ops, failed
+ * ops, total seconds, throughput, the p50/p99/p999 latencies in
+ * microseconds (nearest rank) and the simulated disk time in milliseconds.
+ * bytes is what the whole run moved, 0 if it isn't a data operation.
+ */
+void
+Start()
+{
+    num_samples = 0;
+    num_errors = 0;
+    sim_start = Disk_SimTime();
+}
+
+void
+Sample(double start, int ok)
+{
+    samples[num_samples++] = now() - start;
+    if (!ok) {
+        num_errors++;
+    }
+}
+
+int
+Compare_Double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+double
+Percentile(double p)
+{
+    int rank = (int) ceil(p * num_samples);
+
+    return samples[(rank > 0 ? rank : 1) - 1] * 1e6;
+}
+
+void
+Report(const char *age, const char *op, long bytes)
+{
+    double total = 0;
+    int i;
+
+    for (i = 0; i < num_samples; i++) {
+        total += samples[i];
+    }
+    qsort(samples, num_samples, sizeof(double), Compare_Double);
+    fprintf(results, "%s,%s,%d,%d,%.6f,%.1f,%.2f,%.1f,%.1f,%.1f,%.3f\n",
+            age, op, num_samples, num_errors, total,
+            total > 0 ? num_samples / total : 0.0,
+            total > 0 ? bytes / total / (1024 * 1024) : 0.0,
+            Percentile(0.50), Percentile(0.99), Percentile(0.999),
+            (Disk_SimTime() - sim_start) / 1e6);
+    fflush(results);
+}
+
+/*
+ * Print_Stats
+ *
+ * With a library built with FS_STATS, what the run did per call and per
+ * disk region goes to stderr (so the CSV stays clean); otherwise nothing.
+ */
+void
+Print_Stats(const char *age)
+{
+    static const char *ops[FS_OPS] = {
+        "boot", "format", "sync", "sync_start", "sync_wait", "commit", "create", "open", "read",
+        "write", "seek", "close", "unlink", "create_batch", "unlink_batch", "dir_create",
+        "dir_size", "dir_read", "dir_unlink", "dir_unlink_tree", "dir_open", "dir_next", "dir_close",
+    };
+    static const char *regions[FS_REGIONS] = { "superblock", "bitmaps", "inodes", "journal", "data" };
+    FS_Stats fs;
+    Disk_Stats disk;
+    int i;
+
+    if (FS_GetStats(&fs) == -1 || Disk_GetStats(&disk) == -1) {
+        return;
+    }
+    fprintf(stderr, "%s: stats\n", age);
+    for (i = 0; i < FS_OPS; i++) {
+        if (fs.calls[i] > 0) {
+            fprintf(stderr, "  %-14s %10ld calls %12.1f us avg\n", ops[i], fs.calls[i],
+                    fs.nanoseconds[i] / 1e3 / fs.calls[i]);
+        }
+    }
+    for (i = 0; i < FS_REGIONS; i++) {
+        fprintf(stderr, "  %-14s %10ld sectors read %10ld written\n", regions[i],
+                disk.region_reads[i], disk.region_writes[i]);
+    }
+    fprintf(stderr, "  %ld seeks, %ld sectors apart in all\n", disk.seeks, disk.seek_distance);
+    fprintf(stderr, "  inodes %ld allocated %ld freed, blocks %ld allocated %ld freed, %ld group searches\n",
+            fs.inodes_allocated, fs.inodes_freed, fs.blocks_allocated, fs.blocks_freed, fs.alloc_searches);
+}
+
+/*
+ * Age
+ *
+ * Turns a fresh image into a used one: a few rounds of creating small
+ * files of random sizes in several directories and unlinking a random
+ * half of them, so free space and free inodes end up scattered.
+ */
+void
+Age()
+{
+    char path[64];
+    int round, d, i, fd, len;
+
+    for (d = 0; d < 4; d++) {
+        sprintf(path, "/age%d", d);
+        Dir_Create(path);
+    }
+    for (round = 0; round < BENCH_AGE_ROUNDS; round++) {
+        for (i = 0; i < num_files / 2; i++) {
+            sprintf(path, "/age%d/r%d_%d", i % 4, round, i);
+            File_Create(path);
+            if ((fd = File_Open(path)) >= 0) {
+                len = rand() % (2 * BENCH_RAND_CHUNK);
+                File_Write(fd, data, len);
+                File_Close(fd);
+            }
+        }
+        for (i = 0; i < num_files / 2; i++) {
+            if (rand() % 2) {
+                sprintf(path, "/age%d/r%d_%d", i % 4, round, i);
+                File_Unlink(path);
+            }
+        }
+    }
+    FS_Sync();
+}
+
+/*
+ * Run_Suite
+ *
+ * Every workload once, against whatever image is booted.
+ */
+void
+Run_Suite(const char *age)
+{
+    char path[64];
+    Dir_Entry entries[64];
+    long offset, blocks = BENCH_BIG_BYTES / BENCH_RAND_CHUNK;
+    int i, fd, n;
+    double t;
+
+    FS_ResetStats();
+    Disk_ResetStats();
+    Dir_Create("/bench");
+
+    Start();
+    for (i = 0; i < num_files; i++) {
+        sprintf(path, "/bench/f%d", i);
+        t = now();
+        Sample(t, File_Create(path) == 0);
+    }
+    Report(age, "create", 0);
+
+    Start();
+    for (i = 0; i < num_files; i++) {
+        sprintf(path, "/bench/f%d", rand() % num_files);
+        t = now();
+        if ((fd = File_Open(path)) >= 0) {
+            File_Close(fd);
+        }
+        Sample(t, fd >= 0);
+    }
+    Report(age, "lookup", 0);
+
+    Start();
+    for (i = 0; i < BENCH_LIST_ROUNDS; i++) {
+        t = now();
+        if ((fd = Dir_Open("/bench")) >= 0) {
+            while ((n = Dir_Next(fd, entries, sizeof(entries))) > 0)
+                ;
+            Dir_Close(fd);
+        }
+        Sample(t, fd >= 0 && n == 0);
+    }
+    Report(age, "list", 0);
+
+    File_Create("/bench/big");
+    fd = File_Open("/bench/big");
+
+    Start();
+    for (offset = 0; offset < BENCH_BIG_BYTES; offset += BENCH_SEQ_CHUNK) {
+        t = now();
+        Sample(t, File_Write(fd, data, BENCH_SEQ_CHUNK) == BENCH_SEQ_CHUNK);
+    }
+    Report(age, "seq_write", BENCH_BIG_BYTES);
+
+    Start();
+    File_Seek(fd, 0);
+    for (offset = 0; offset < BENCH_BIG_BYTES; offset += BENCH_SEQ_CHUNK) {
+        t = now();
+        Sample(t, File_Read(fd, data, BENCH_SEQ_CHUNK) == BENCH_SEQ_CHUNK);
+    }
+    Report(age, "seq_read", BENCH_BIG_BYTES);
+
+    Start();
+    for (i = 0; i < BENCH_RAND_OPS; i++) {
+        t = now();
+        File_Seek(fd, (rand() % blocks) * BENCH_RAND_CHUNK);
+        Sample(t, File_Write(fd, data, BENCH_RAND_CHUNK) == BENCH_RAND_CHUNK);
+    }
+    Report(age, "rand_write", (long) BENCH_RAND_OPS * BENCH_RAND_CHUNK);
+
+    Start();
+    for (i = 0; i < BENCH_RAND_OPS; i++) {
+        t = now();
+        File_Seek(fd, (rand() % blocks) * BENCH_RAND_CHUNK);
+        Sample(t, File_Read(fd, data, BENCH_RAND_CHUNK) == BENCH_RAND_CHUNK);
+    }
+    Report(age, "rand_read", (long) BENCH_RAND_OPS * BENCH_RAND_CHUNK);
+    File_Close(fd);
+
+    // Each sync has a little of everything to write back
+    Start();
+    for (i = 0; i < BENCH_SYNC_ROUNDS; i++) {
+        sprintf(path, "/bench/s%d", i);
+        File_Create(path);
+        fd = File_Open(path);
+        File_Write(fd, data, BENCH_SEQ_CHUNK);
+        File_Close(fd);
+        t = now();
+        Sample(t, FS_Sync() == 0);
+    }
+    Report(age, "sync", 0);
+
+    Start();
+    for (i = 0; i < BENCH_BOOT_ROUNDS; i++) {
+        t = now();
+        Sample(t, FS_Boot(image) == 0);
+    }
+    Report(age, "boot", 0);
+
+    Start();
+    for (i = 0; i < num_files; i++) {
+        sprintf(path, "/bench/f%d", i);
+        t = now();
+        Sample(t, File_Unlink(path) == 0);
+    }
+    Report(age, "unlink", 0);
+
+    // What is left of the tree goes in one call
+    Start();
+    t = now();
+    Sample(t, Dir_UnlinkTree("/bench") == 0);
+    Report(age, "unlink_tree", 0);
+
+    FS_Sync();
+    Print_Stats(age);
+}
+
+int
+main(int argc, char *argv[])
+{
+    Disk_Model model;
+    int max_samples, type = DISK_MODEL_NONE;
+
+    if (argc < 2 || argc > 4) {
+        usage(argv[0]);
+    }
+    image = argv[1];
+    if (argc >= 3 && (num_files = atoi(argv[2])) <= 0) {
+        usage(argv[0]);
+    }
+    if (argc == 4) {
+        if (strcmp(argv[3], "hdd") == 0) {
+            type = DISK_MODEL_HDD;
+        } else if (strcmp(argv[3], "ssd") == 0) {
+            type = DISK_MODEL_SSD;
+        } else if (strcmp(argv[3], "none") != 0) {
+            usage(argv[0]);
+        }
+    }
+    Disk_DefaultModel(type, &model);
+    Disk_SetModel(&model);
+
+    max_samples = num_files;
+    if (max_samples < BENCH_RAND_OPS) {
+        max_samples = BENCH_RAND_OPS;
+    }
+    if (max_samples < BENCH_BIG_BYTES / BENCH_SEQ_CHUNK) {
+        max_samples = BENCH_BIG_BYTES / BENCH_SEQ_CHUNK;
+    }
+    if ((samples = malloc(max_samples * sizeof(double))) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    // Keep the results, lose the library's output
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    if (results == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        fprintf(stderr, "can't set up output\n");
+        return 1;
+    }
+    fprintf(results, "image,op,ops,errors,seconds,ops_per_sec,mb_per_sec,p50_us,p99_us,p999_us,sim_ms\n");
+
+    srand(1);
+    memset(data, 'b', sizeof(data));
+
+    if (FS_Format(image, BENCH_BLOCK_SIZE, BENCH_NUM_BLOCKS, BENCH_NUM_INODES) == -1) {
+        fprintf(stderr, "FS_Format %s failed\n", image);
+        return 1;
+    }
+    Run_Suite("fresh");
+
+    if (FS_Format(image, BENCH_BLOCK_SIZE, BENCH_NUM_BLOCKS, BENCH_NUM_INODES) == -1) {
+        fprintf(stderr, "FS_Format %s failed\n", image);
+        return 1;
+    }
+    Age();
+    Run_Suite("aged");
+
+    return 0;
+}